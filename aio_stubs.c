@@ -0,0 +1,2667 @@
+/* aio_stubs.c: C bindings for Aio module
+ * Copyright (C) 2010 Goswin von Brederlow
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * Under Debian a copy can be found in /usr/share/common-licenses/LGPL-2.1.
+ */
+
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <libaio.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <linux/fs.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/callback.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+#include <caml/custom.h>
+#include <caml/bigarray.h>
+#include <caml/version.h>
+
+/* Per request flags of preadv2/pwritev2, missing in older headers */
+#ifndef RWF_HIPRI
+#define RWF_HIPRI	0x00000001
+#endif
+#ifndef RWF_DSYNC
+#define RWF_DSYNC	0x00000002
+#endif
+#ifndef RWF_SYNC
+#define RWF_SYNC	0x00000004
+#endif
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT	0x00000008
+#endif
+
+/* Everything about the request occupying a slot.
+ * cb:   storage of the slot's iocb, all iocbs of a context are in the
+ *       one slots array
+ * fn:   continuation, or cookie of a tagged request
+ * buf:  buffer(s) the kernel uses, kept alive with fn
+ * live: fn and buf are registered as generational global roots
+ * iocb: the iocb of the request occupying the slot
+ * len:  number of bytes the request asked to transfer
+ * iov:  iovec storage for vectored requests, grown as needed
+ * err:  errno of a request the kernel refused to accept
+ * next: next slot in the list of failed requests
+ * start: time the request was prepared in ns
+ * id:   handle of a request started with Aio.start, 0 otherwise
+ * cancelled: the continuation was called already, the completion of
+ *       the iocb only frees the slot
+ * queued: the iocb waits in the ring of prepared iocbs, the kernel
+ *       hasn't seen it yet
+ * timer: index of the deadline in the timer heap plus 1, 0 if none
+ */
+typedef struct Slot {
+  struct iocb cb;
+  value fn;
+  value buf;
+  int live;
+  struct iocb *iocb;
+  size_t len;
+  uint64_t start;
+  int iov_max;
+  struct iovec *iov;
+  int err;
+  intptr_t next;
+  intnat id;
+  int cancelled;
+  int queued;
+  int timer;
+} Slot;
+
+/* Deadline of a request in the timer heap of the context. The entry is
+ * removed when the request completes or is cancelled.
+ */
+typedef struct Timer {
+  uint64_t when;	// CLOCK_MONOTONIC in ns
+  intptr_t slot;
+} Timer;
+
+/* Counters kept per context for Aio.stats. The latency of a request
+ * from preparing it to reaping its completion goes into bucket b of
+ * the histogram for its kind when it took less than 2^b us.
+ */
+enum {
+  KIND_READ,
+  KIND_WRITE,
+  KIND_SYNC,
+  KIND_POLL,
+  NR_KINDS,
+};
+
+#define NR_BUCKETS 32
+
+typedef struct Stats {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t partial;
+  uint64_t errors;
+  uint64_t eagain;	// io_submit refused for lack of resources
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  int max_inflight;	// high-water mark of iocbs in the kernel
+  uint64_t latency[NR_KINDS][NR_BUCKETS];
+} Stats;
+
+/* The iocbs array holds 2 * max_ios entries:
+ * [0, max_ios)           stack of iocbs, the ones from pending up are free
+ * [max_ios, 2 * max_ios) ring of prepared iocbs waiting for io_submit
+ *
+ * Continuation and buffer of a request live in its Slot, registered as
+ * generational global roots from reserve to release. Only live slots
+ * are roots, so a minor GC looks at nothing but requests submitted
+ * since the last one and submitting costs no write barrier on a big
+ * major heap block, whatever the size of the context. A context
+ * dropped with pending requests whose continuations reference it stays
+ * alive until they complete.
+ *
+ * Requests that find no free slot are kept as Aio.command values in a
+ * list in the small OCaml tuple of the context until a slot frees up.
+ *
+ * The iocbs describe requests for both backends. With io_uring they are
+ * never seen by the kernel but translated into sqes when flushed.
+ *
+ * The Context is malloced and the custom block only holds a pointer to
+ * it so it stays put while run waits without the runtime lock. All
+ * fields are only touched with the runtime lock held; the blocking
+ * section covers nothing but the wait in the kernel. Only one thread
+ * at a time may collect completions, reaping is set while it waits in
+ * the kernel. Other threads then leave the completions to it or wait
+ * on the reaped condition for it to finish.
+ *
+ * Aio.Sharded also locks the whole Context for one thread, which may
+ * take it again. A thread about to wait in the kernel or for the
+ * reaper lets go of that lock meanwhile and takes it back afterwards,
+ * so other domains can use the context while it sleeps.
+ *
+ * Tagged requests store an OCaml int instead of a continuation in the
+ * callback field of their slot. Their completions are appended to the
+ * done array as (cookie, res, res2) in the data, res and res2 fields of
+ * an io_event and handed out by reap.
+ */
+enum {
+  BACKEND_LIBAIO,
+  BACKEND_URING,
+};
+
+typedef struct Context {
+  int backend;
+  io_context_t ctx;
+#ifdef HAVE_LIBURING
+  struct io_uring ring;
+  struct iovec *reg_bufs;	// registered buffers
+  int nr_reg_bufs;
+  int *reg_fds;			// registered files
+  int nr_reg_fds;
+#endif
+  int max_ios;
+  int depth;		// target number of iocbs in the kernel
+  int pending;		// slots in use
+  int inflight;		// iocbs submitted to the kernel
+  int queued;		// prepared iocbs in the ring
+  int queue_head;	// first prepared iocb in the ring
+  int overflow;		// requests waiting for a slot
+  int max_queued;	// high-water mark of queued + overflow
+  int overflowed;	// number of requests that had to wait for a slot
+  intptr_t failed;	// list of refused requests, 0 if empty
+  intptr_t failed_tail;
+  struct io_event *done;	// completed tagged requests not reaped yet
+  int done_head;	// first entry not reaped yet
+  int nr_done;		// end of the entries
+  int done_max;		// allocated entries
+  uint64_t now;		// time the last batch of events was reaped in ns
+  intnat last_id;	// handle of the last request started
+  Timer *timers;	// heap of deadlines, earliest first
+  int nr_timers;
+  int timers_max;
+  int reaping;		// a thread waits in the kernel for completions
+  pthread_mutex_t lock;	// protects reaping, owner and lock_depth
+  pthread_cond_t reaped;	// signalled when reaping ends
+  pthread_t owner;	// holder of the shard lock
+  int lock_depth;	// times the owner took it, 0 if free
+  pthread_cond_t unlocked;	// signalled when the shard lock is freed
+  Stats stats;
+  int fd;
+  Slot *slots;
+  struct iocb *iocbs[0];
+} Context;
+
+#define Context_val(v) (*(Context**)Data_custom_val(Field((v), 0)))
+#define Overflow_head(ctx) 1
+#define Overflow_tail(ctx) 2
+#define Registered_buffers(ctx) 3
+
+CAMLprim value caml_aio_run(value context);
+
+void caml_aio_context_finalize(value v) {
+  Context *ctx = *(Context**)Data_custom_val(v);
+  int i;
+  //fprintf(stderr, "### caml_aio_context_finalize()\n");
+  if (ctx->pending > 0) {
+    fprintf(stderr, "Error: pending io on Aio.context.\n");
+    fflush(stderr);
+  }
+  close(ctx->fd);
+#ifdef HAVE_LIBURING
+  if (ctx->backend == BACKEND_URING) {
+    io_uring_queue_exit(&ctx->ring);
+    free(ctx->reg_bufs);
+    free(ctx->reg_fds);
+  } else
+#endif
+  {
+    // FIXME: Can't throw exception. What's to do?
+    assert(io_queue_release(ctx->ctx) == 0);
+  }
+  for(i = 0; i < ctx->max_ios; ++i) {
+    if (ctx->slots[i].live) {
+      caml_remove_generational_global_root(&ctx->slots[i].fn);
+      caml_remove_generational_global_root(&ctx->slots[i].buf);
+    }
+    free(ctx->slots[i].iov);
+  }
+  free(ctx->slots);
+  free(ctx->done);
+  free(ctx->timers);
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->reaped);
+  pthread_cond_destroy(&ctx->unlocked);
+  free(ctx);
+}
+
+static struct custom_operations caml_aio_context_ops = {
+  "vonbrederlow.de.aio.context",
+  caml_aio_context_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+};
+
+/* Raise Aio.Error with the given errno. */
+static void caml_aio_raise_error(int err) {
+  static const value * exn_error = NULL;
+  if (exn_error == NULL) {
+    /* First time around, look up by name */
+    exn_error = caml_named_value("caml_aio_exn_error");
+  }
+  caml_raise_with_arg(*exn_error, Val_int(err));
+}
+
+/* Allocate the OCaml tuple and Context for max_ios requests. The
+ * backend specific part is left for the caller to fill in.
+ */
+static value caml_aio_alloc_context(int max_ios, int backend) {
+  CAMLparam0();
+  CAMLlocal2(ml_ctx, ml_context);
+  intptr_t i;
+
+  /*
+   * context
+   * overflow head
+   * overflow tail
+   * registered buffers
+   */
+  Context *context = calloc(1, sizeof(Context) + 2 * max_ios * sizeof(struct iocb*));
+  // FIXME: throw exception
+  assert(context);
+  ml_context = caml_alloc_custom(&caml_aio_context_ops, sizeof(Context*), 0, 1);
+  *(Context**)Data_custom_val(ml_context) = context;
+  ml_ctx = caml_alloc_tuple(4);
+  Store_field(ml_ctx, 0, ml_context);
+  for(i = 1; i <= 3; ++i) {
+    Store_field(ml_ctx, i, Val_unit);
+  }
+
+  context->slots = calloc(max_ios, sizeof(Slot));
+  // FIXME: throw exception
+  assert(context->slots);
+  for(i = 0; i < max_ios; ++i) {
+    Slot *s = &context->slots[i];
+    s->fn = Val_unit;
+    s->buf = Val_unit;
+    s->iocb = &s->cb;
+    // Slot numbers are odd so 0 can end the list of failed requests
+    s->cb.data = (void*)(2 * i + 1);
+    context->iocbs[i] = &s->cb;
+  }
+
+  context->backend = backend;
+  context->max_ios = max_ios;
+  context->depth = max_ios;
+  pthread_mutex_init(&context->lock, NULL);
+  pthread_cond_init(&context->reaped, NULL);
+  pthread_cond_init(&context->unlocked, NULL);
+
+  CAMLreturn(ml_ctx);
+}
+
+/* context: fun max_ios -> context
+external context: int -> context = "caml_aio_context"
+*/
+CAMLprim value caml_aio_context(value ml_max_ios) {
+  CAMLparam1(ml_max_ios);
+  CAMLlocal1(ml_ctx);
+  int max_ios = Int_val(ml_max_ios);
+  //fprintf(stderr, "### caml_aio_context(%d)\n", max_ios);
+
+  if (max_ios <= 0) {
+    caml_invalid_argument("Aio.context: max_ios must be positive.");
+  }
+
+  ml_ctx = caml_aio_alloc_context(max_ios, BACKEND_LIBAIO);
+  Context *context = Context_val(ml_ctx);
+
+  // FIXME: throw exception
+  assert(io_queue_init(max_ios, &context->ctx) == 0);
+  context->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  // FIXME: throw exception
+  assert(context->fd != -1);
+
+  CAMLreturn(ml_ctx);
+}
+
+/* uring_context: fun max_ios sqpoll -> context
+external uring_context: int -> bool -> context = "caml_aio_uring_context"
+*/
+CAMLprim value caml_aio_uring_context(value ml_max_ios, value ml_sqpoll) {
+  CAMLparam2(ml_max_ios, ml_sqpoll);
+  CAMLlocal1(ml_ctx);
+  int max_ios = Int_val(ml_max_ios);
+  //fprintf(stderr, "### caml_aio_uring_context(%d)\n", max_ios);
+
+  if (max_ios <= 0) {
+    caml_invalid_argument("Aio.context: max_ios must be positive.");
+  }
+
+#ifdef HAVE_LIBURING
+  struct io_uring ring;
+  struct io_uring_params params;
+  int fd, res;
+
+  // Set up the ring first, the finalizer must not see half a context
+  memset(&params, 0, sizeof(params));
+  if (Bool_val(ml_sqpoll)) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 1000;
+  }
+  res = io_uring_queue_init_params(max_ios, &ring, &params);
+  if (res < 0) caml_aio_raise_error(-res);
+  fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) {
+    res = errno;
+    io_uring_queue_exit(&ring);
+    caml_aio_raise_error(res);
+  }
+  res = io_uring_register_eventfd(&ring, fd);
+  if (res < 0) {
+    close(fd);
+    io_uring_queue_exit(&ring);
+    caml_aio_raise_error(-res);
+  }
+
+  ml_ctx = caml_aio_alloc_context(max_ios, BACKEND_URING);
+  Context *context = Context_val(ml_ctx);
+  context->ring = ring;
+  context->fd = fd;
+
+  CAMLreturn(ml_ctx);
+#else
+  (void)ml_ctx;
+  caml_aio_raise_error(ENOSYS);
+#endif
+}
+
+/* uring_available: fun () -> bool
+external uring_available : unit -> bool = "caml_aio_uring_available"
+*/
+CAMLprim value caml_aio_uring_available(value ml_unit) {
+  (void)ml_unit;
+#ifdef HAVE_LIBURING
+  return Val_true;
+#else
+  return Val_false;
+#endif
+}
+
+/* Monotonic time in ns. */
+static uint64_t caml_aio_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Kind of request for the statistics. */
+static int caml_aio_kind(struct iocb *iocb) {
+  switch(iocb->aio_lio_opcode) {
+  case IO_CMD_PREAD:
+  case IO_CMD_PREADV:
+    return KIND_READ;
+  case IO_CMD_PWRITE:
+  case IO_CMD_PWRITEV:
+    return KIND_WRITE;
+  case IO_CMD_POLL:
+    return KIND_POLL;
+  default:
+    return KIND_SYNC;
+  }
+}
+
+/* Account for a completed request. */
+static void caml_aio_count(Context *ctx, struct iocb *iocb, uint64_t start, size_t len, long res, long res2) {
+  Stats *st = &ctx->stats;
+  int kind = caml_aio_kind(iocb);
+  uint64_t us = (ctx->now > start) ? (ctx->now - start) / 1000 : 0;
+  int bucket = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+
+  if (bucket >= NR_BUCKETS) bucket = NR_BUCKETS - 1;
+  ++st->latency[kind][bucket];
+  ++st->completed;
+  if (res2 != 0 || res < 0) {
+    ++st->errors;
+    return;
+  }
+  // The result of a poll is the mask of ready events
+  if (kind == KIND_POLL) return;
+  if ((size_t)res != len) ++st->partial;
+  if (kind == KIND_READ) st->bytes_read += res;
+  if (kind == KIND_WRITE) st->bytes_written += res;
+}
+
+/* Can a new request get a slot right away? Requests have to wait
+ * behind the overflow list to keep them in order.
+ */
+static int caml_aio_has_slot(Context *ctx) {
+  return ctx->pending < ctx->max_ios && ctx->overflow == 0;
+}
+
+static void caml_aio_update_max_queued(Context *ctx) {
+  if (ctx->queued + ctx->overflow > ctx->max_queued) {
+    ctx->max_queued = ctx->queued + ctx->overflow;
+  }
+}
+
+/* Reserve the next free iocb and remember callback and buffer in its
+ * slot. The caller prepares the iocb and then calls caml_aio_finish().
+ */
+static struct iocb *caml_aio_reserve(value ml_ctx, value ml_fn, value ml_buffer, intptr_t *slot) {
+  Context *ctx = Context_val(ml_ctx);
+  assert(ctx->pending < ctx->max_ios);
+
+  struct iocb *iocb = ctx->iocbs[ctx->pending];
+  *slot = (intptr_t)iocb->data;
+  Slot *s = &ctx->slots[*slot / 2];
+
+  s->fn = ml_fn;
+  s->buf = ml_buffer;
+  caml_register_generational_global_root(&s->fn);
+  caml_register_generational_global_root(&s->buf);
+  s->live = 1;
+  ++ctx->pending;
+
+  return iocb;
+}
+
+/* Finish a prepared iocb: notify the eventfd on completion, record the
+ * slot and expected length of the transfer and queue it for io_submit.
+ */
+static void caml_aio_finish(Context *ctx, struct iocb *iocb, intptr_t slot, size_t len) {
+  io_set_eventfd(iocb, ctx->fd);
+  iocb->data = (void*)slot;
+  ctx->slots[slot / 2].iocb = iocb;
+  ctx->slots[slot / 2].len = len;
+  ctx->slots[slot / 2].start = caml_aio_clock();
+  ctx->slots[slot / 2].id = 0;
+  ctx->slots[slot / 2].cancelled = 0;
+  ctx->slots[slot / 2].queued = 1;
+  ++ctx->stats.submitted;
+  ctx->iocbs[ctx->max_ios + (ctx->queue_head + ctx->queued) % ctx->max_ios] = iocb;
+  ++ctx->queued;
+  caml_aio_update_max_queued(ctx);
+}
+
+/* Check that [buf_off, buf_off + len) lies within the buffer. */
+static void caml_aio_check_range(value ml_buffer, value ml_buf_off, value ml_len) {
+  intnat buf_off = Long_val(ml_buf_off);
+  intnat len = Long_val(ml_len);
+  intnat dim = Bigarray_val(ml_buffer)->dim[0];
+
+  if (buf_off < 0 || len < 0 || buf_off > dim || len > dim - buf_off) {
+    caml_invalid_argument("Aio: Index out of bounds.");
+  }
+}
+
+/* Prepare the next free iocb for a pread/pwrite of len bytes starting at
+ * buf_off in the buffer with the given RWF_* flags and remember callback
+ * and buffer in its slot.
+ */
+static void caml_aio_prep_rw(value ml_ctx, int opcode, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn, int flags) {
+  int fd = Int_val(ml_fd);
+  uint64_t fd_off = Int64_val(ml_fd_off);
+  intnat buf_off = Long_val(ml_buf_off);
+  intnat len = Long_val(ml_len);
+  char *buf = (char*)Data_bigarray_val(ml_buffer);
+  intptr_t slot;
+
+  caml_aio_check_range(ml_buffer, ml_buf_off, ml_len);
+
+  struct iocb *iocb = caml_aio_reserve(ml_ctx, ml_fn, ml_buffer, &slot);
+
+  if (opcode == IO_CMD_PREAD) {
+    io_prep_pread(iocb, fd, buf + buf_off, len, fd_off);
+  } else {
+    io_prep_pwrite(iocb, fd, buf + buf_off, len, fd_off);
+  }
+  iocb->aio_rw_flags = flags;
+  caml_aio_finish(Context_val(ml_ctx), iocb, slot, len);
+}
+
+/* Check that an array of buffers fits into one vectored request. */
+static void caml_aio_check_vec(value ml_buffers) {
+  if (Wosize_val(ml_buffers) > IOV_MAX) {
+    caml_invalid_argument("Aio: Too many buffers.");
+  }
+}
+
+/* Prepare the next free iocb for a preadv/pwritev into/from an array of
+ * buffers and remember callback and buffers in its slot.
+ */
+static void caml_aio_prep_vec(value ml_ctx, int opcode, value ml_fd, value ml_fd_off, value ml_buffers, value ml_fn) {
+  int fd = Int_val(ml_fd);
+  uint64_t fd_off = Int64_val(ml_fd_off);
+  int iovcnt = Wosize_val(ml_buffers);
+  size_t len = 0;
+  intptr_t slot;
+  int i;
+
+  caml_aio_check_vec(ml_buffers);
+
+  struct iocb *iocb = caml_aio_reserve(ml_ctx, ml_fn, ml_buffers, &slot);
+  Context *ctx = Context_val(ml_ctx);
+  Slot *s = &ctx->slots[slot / 2];
+
+  if (s->iov_max < iovcnt) {
+    struct iovec *iov = realloc(s->iov, iovcnt * sizeof(struct iovec));
+    // FIXME: throw exception
+    assert(iov);
+    s->iov = iov;
+    s->iov_max = iovcnt;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    value ml_buffer = Field(ml_buffers, i);
+    s->iov[i].iov_base = Data_bigarray_val(ml_buffer);
+    s->iov[i].iov_len = Bigarray_val(ml_buffer)->dim[0];
+    len += s->iov[i].iov_len;
+  }
+
+  if (opcode == IO_CMD_PREADV) {
+    io_prep_preadv(iocb, fd, s->iov, iovcnt, fd_off);
+  } else {
+    io_prep_pwritev(iocb, fd, s->iov, iovcnt, fd_off);
+  }
+  caml_aio_finish(ctx, iocb, slot, len);
+}
+
+/* Prepare the next free iocb for a fsync/fdatasync and remember the
+ * callback in its slot.
+ */
+static void caml_aio_prep_sync(value ml_ctx, int opcode, value ml_fd, value ml_fn) {
+  int fd = Int_val(ml_fd);
+  intptr_t slot;
+
+  struct iocb *iocb = caml_aio_reserve(ml_ctx, ml_fn, Val_unit, &slot);
+
+  if (opcode == IO_CMD_FSYNC) {
+    io_prep_fsync(iocb, fd);
+  } else {
+    io_prep_fdsync(iocb, fd);
+  }
+  caml_aio_finish(Context_val(ml_ctx), iocb, slot, 0);
+}
+
+/* Poll events in the order of the Aio.poll_event constructors */
+static int poll_event_table[] = {
+  POLLIN, POLLPRI, POLLOUT, POLLERR, POLLHUP, POLLRDHUP,
+};
+
+#define NR_POLL_EVENTS (sizeof(poll_event_table) / sizeof(poll_event_table[0]))
+
+/* Prepare the next free iocb for a poll and remember the callback in
+ * its slot.
+ */
+static void caml_aio_prep_poll(value ml_ctx, value ml_fd, value ml_events, value ml_fn) {
+  int events = caml_convert_flag_list(ml_events, poll_event_table);
+  intptr_t slot;
+
+  struct iocb *iocb = caml_aio_reserve(ml_ctx, ml_fn, Val_unit, &slot);
+  io_prep_poll(iocb, Int_val(ml_fd), events);
+  caml_aio_finish(Context_val(ml_ctx), iocb, slot, 0);
+}
+
+/* Tags of the Aio.command constructors */
+enum {
+  CMD_READ,
+  CMD_WRITE,
+  CMD_READV,
+  CMD_WRITEV,
+  CMD_FSYNC,
+  CMD_FDSYNC,
+  CMD_POLL,
+};
+
+/* Check the arguments of a command before anything is reserved for it. */
+static void caml_aio_check_cmd(value ml_cmd) {
+  switch(Tag_val(ml_cmd)) {
+  case CMD_READ:
+  case CMD_WRITE:
+    caml_aio_check_range(Field(ml_cmd, 2), Field(ml_cmd, 3), Field(ml_cmd, 4));
+    break;
+  case CMD_READV:
+  case CMD_WRITEV:
+    caml_aio_check_vec(Field(ml_cmd, 2));
+    break;
+  }
+}
+
+/* Prepare the next free iocb for a command. Reads and writes get the
+ * RWF_* flags.
+ */
+static void caml_aio_prep_cmd(value ml_ctx, value ml_cmd, int flags) {
+  switch(Tag_val(ml_cmd)) {
+  case CMD_READ:
+  case CMD_WRITE:
+    caml_aio_prep_rw(ml_ctx,
+		     Tag_val(ml_cmd) == CMD_READ ? IO_CMD_PREAD : IO_CMD_PWRITE,
+		     Field(ml_cmd, 0), Field(ml_cmd, 1), Field(ml_cmd, 2),
+		     Field(ml_cmd, 3), Field(ml_cmd, 4), Field(ml_cmd, 5), flags);
+    break;
+  case CMD_READV:
+  case CMD_WRITEV:
+    caml_aio_prep_vec(ml_ctx,
+		      Tag_val(ml_cmd) == CMD_READV ? IO_CMD_PREADV : IO_CMD_PWRITEV,
+		      Field(ml_cmd, 0), Field(ml_cmd, 1), Field(ml_cmd, 2),
+		      Field(ml_cmd, 3));
+    break;
+  case CMD_FSYNC:
+  case CMD_FDSYNC:
+    caml_aio_prep_sync(ml_ctx,
+		       Tag_val(ml_cmd) == CMD_FSYNC ? IO_CMD_FSYNC : IO_CMD_FDSYNC,
+		       Field(ml_cmd, 0), Field(ml_cmd, 1));
+    break;
+  case CMD_POLL:
+    caml_aio_prep_poll(ml_ctx, Field(ml_cmd, 0), Field(ml_cmd, 1),
+		       Field(ml_cmd, 2));
+    break;
+  }
+}
+
+/* Build the command for a pread/pwrite that has to wait for a slot. */
+static value caml_aio_make_rw(int tag, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn) {
+  CAMLparam5(ml_fd, ml_fd_off, ml_buffer, ml_buf_off, ml_len);
+  CAMLxparam1(ml_fn);
+  CAMLlocal1(ml_cmd);
+
+  ml_cmd = caml_alloc(6, tag);
+  Store_field(ml_cmd, 0, ml_fd);
+  Store_field(ml_cmd, 1, ml_fd_off);
+  Store_field(ml_cmd, 2, ml_buffer);
+  Store_field(ml_cmd, 3, ml_buf_off);
+  Store_field(ml_cmd, 4, ml_len);
+  Store_field(ml_cmd, 5, ml_fn);
+
+  CAMLreturn(ml_cmd);
+}
+
+/* Append a command with RWF_* flags to the overflow list of the
+ * context. Requests from Aio.start carry their handle and deadline
+ * along, the others have () and 0.
+ */
+static void caml_aio_overflow_push_req(value ml_ctx, value ml_cmd, int flags, value ml_req, uint64_t deadline) {
+  CAMLparam3(ml_ctx, ml_cmd, ml_req);
+  CAMLlocal1(ml_node);
+  Context *ctx;
+
+  ml_node = caml_alloc_small(5, 0);
+  Field(ml_node, 0) = ml_cmd;
+  Field(ml_node, 1) = Val_unit;
+  Field(ml_node, 2) = Val_int(flags);
+  Field(ml_node, 3) = ml_req;
+  Field(ml_node, 4) = Val_long(deadline);
+
+  ctx = Context_val(ml_ctx);
+  if (ctx->overflow == 0) {
+    Store_field(ml_ctx, Overflow_head(ctx), ml_node);
+  } else {
+    Store_field(Field(ml_ctx, Overflow_tail(ctx)), 1, ml_node);
+  }
+  Store_field(ml_ctx, Overflow_tail(ctx), ml_node);
+  ++ctx->overflow;
+  ++ctx->overflowed;
+  caml_aio_update_max_queued(ctx);
+
+  CAMLreturn0;
+}
+
+static void caml_aio_overflow_push_flags(value ml_ctx, value ml_cmd, int flags) {
+  caml_aio_overflow_push_req(ml_ctx, ml_cmd, flags, Val_unit, 0);
+}
+
+/* Append a command to the overflow list of the context. */
+static void caml_aio_overflow_push(value ml_ctx, value ml_cmd) {
+  caml_aio_overflow_push_flags(ml_ctx, ml_cmd, 0);
+}
+
+/* Put a deadline at index i of the timer heap and tell its slot. */
+static void caml_aio_timer_set(Context *ctx, int i, Timer timer) {
+  ctx->timers[i] = timer;
+  ctx->slots[timer.slot / 2].timer = i + 1;
+}
+
+/* Move a deadline from the hole at index i up to its place. */
+static void caml_aio_timer_up(Context *ctx, int i, Timer timer) {
+  while (i > 0 && ctx->timers[(i - 1) / 2].when > timer.when) {
+    caml_aio_timer_set(ctx, i, ctx->timers[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  caml_aio_timer_set(ctx, i, timer);
+}
+
+/* Move a deadline from the hole at index i down to its place. */
+static void caml_aio_timer_down(Context *ctx, int i, Timer timer) {
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= ctx->nr_timers) break;
+    if (child + 1 < ctx->nr_timers
+	&& ctx->timers[child + 1].when < ctx->timers[child].when) {
+      ++child;
+    }
+    if (ctx->timers[child].when >= timer.when) break;
+    caml_aio_timer_set(ctx, i, ctx->timers[child]);
+    i = child;
+  }
+  caml_aio_timer_set(ctx, i, timer);
+}
+
+/* Add a deadline to the timer heap. */
+static void caml_aio_timer_push(Context *ctx, uint64_t when, intptr_t slot) {
+  Timer timer;
+
+  if (ctx->nr_timers == ctx->timers_max) {
+    int max = (ctx->timers_max > 0) ? 2 * ctx->timers_max : 16;
+    Timer *timers = realloc(ctx->timers, max * sizeof(Timer));
+    // FIXME: throw exception
+    assert(timers);
+    ctx->timers = timers;
+    ctx->timers_max = max;
+  }
+  timer.when = when;
+  timer.slot = slot;
+  caml_aio_timer_up(ctx, ctx->nr_timers++, timer);
+}
+
+/* Remove the deadline of the request in slot, if it has one. */
+static void caml_aio_timer_remove(Context *ctx, intptr_t slot) {
+  Slot *s = &ctx->slots[slot / 2];
+  int i = s->timer - 1;
+  Timer last;
+
+  if (i < 0) return;
+  s->timer = 0;
+  last = ctx->timers[--ctx->nr_timers];
+  if (i == ctx->nr_timers) return;
+  if (i > 0 && ctx->timers[(i - 1) / 2].when > last.when) {
+    caml_aio_timer_up(ctx, i, last);
+  } else {
+    caml_aio_timer_down(ctx, i, last);
+  }
+}
+
+/* Give the request just prepared in the top slot its handle and
+ * deadline. The handle learns the slot so cancel finds it right away.
+ */
+static void caml_aio_tag(Context *ctx, value ml_req, uint64_t deadline) {
+  intptr_t slot = (intptr_t)ctx->iocbs[ctx->pending - 1]->data;
+
+  ctx->slots[slot / 2].id = Long_val(Field(ml_req, 0));
+  Field(ml_req, 1) = Val_long(slot);
+  if (deadline != 0) caml_aio_timer_push(ctx, deadline, slot);
+}
+
+/* Time left until the earliest deadline, NULL if there is none. */
+static struct timespec *caml_aio_timeout(Context *ctx, struct timespec *ts) {
+  uint64_t now, left = 0;
+
+  if (ctx->nr_timers == 0) return NULL;
+  now = caml_aio_clock();
+  if (ctx->timers[0].when > now) left = ctx->timers[0].when - now;
+  ts->tv_sec = left / 1000000000;
+  ts->tv_nsec = left % 1000000000;
+  return ts;
+}
+
+/* Put a request the kernel refused on the failed list. Its continuation
+ * is called with the error by the next run/process. The eventfd is
+ * bumped so an event loop waiting on it notices.
+ */
+static void caml_aio_fail(Context *ctx, struct iocb *iocb, int err) {
+  intptr_t slot = (intptr_t)iocb->data;
+  Slot *s = &ctx->slots[slot / 2];
+  uint64_t one = 1;
+
+  s->err = err;
+  s->next = 0;
+  if (ctx->failed == 0) {
+    ctx->failed = slot;
+  } else {
+    ctx->slots[ctx->failed_tail / 2].next = slot;
+  }
+  ctx->failed_tail = slot;
+  (void)write(ctx->fd, &one, sizeof(one));
+}
+
+/* Mark n iocbs of the ring starting at first as seen by the kernel. */
+static void caml_aio_dequeued(Context *ctx, int first, int n) {
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    struct iocb *iocb = ctx->iocbs[ctx->max_ios + (first + i) % ctx->max_ios];
+    ctx->slots[(intptr_t)iocb->data / 2].queued = 0;
+  }
+}
+
+/* Take a prepared iocb out of the ring before the kernel sees it. The
+ * iocbs behind it move up to close the gap.
+ */
+static void caml_aio_unqueue(Context *ctx, struct iocb *iocb) {
+  struct iocb **ring = &ctx->iocbs[ctx->max_ios];
+  int max = ctx->max_ios;
+  int head = ctx->queue_head;
+  int k;
+
+  for (k = 0; k < ctx->queued; ++k) {
+    if (ring[(head + k) % max] == iocb) break;
+  }
+  assert(k < ctx->queued);
+  for (; k + 1 < ctx->queued; ++k) {
+    ring[(head + k) % max] = ring[(head + k + 1) % max];
+  }
+  --ctx->queued;
+  ctx->slots[(intptr_t)iocb->data / 2].queued = 0;
+}
+
+/* Hand prepared iocbs from the ring to libaio while it has room for
+ * them. The kernel may accept fewer iocbs than asked, the remainder
+ * stays queued. EAGAIN leaves the queue alone to be retried once
+ * completions free up resources; any other error fails the first iocb,
+ * which is the one the kernel rejected.
+ */
+static void caml_aio_flush_libaio(Context *ctx) {
+  while (ctx->queued > 0 && ctx->inflight < ctx->depth) {
+    int n = ctx->depth - ctx->inflight;
+    int first = ctx->queue_head;
+    if (n > ctx->queued) n = ctx->queued;
+    // Submit at most up to the wrap around of the ring
+    if (n > ctx->max_ios - first) n = ctx->max_ios - first;
+
+    int res = io_submit(ctx->ctx, n, &ctx->iocbs[ctx->max_ios + first]);
+    if (res == -EAGAIN || res == 0) {
+      ++ctx->stats.eagain;
+      break;
+    }
+    if (res < 0) {
+      caml_aio_fail(ctx, ctx->iocbs[ctx->max_ios + first], -res);
+      res = 1;
+      caml_aio_dequeued(ctx, first, 1);
+    } else {
+      caml_aio_dequeued(ctx, first, res);
+      ctx->inflight += res;
+      if (ctx->inflight > ctx->stats.max_inflight) {
+	ctx->stats.max_inflight = ctx->inflight;
+      }
+    }
+    ctx->queue_head = (first + res) % ctx->max_ios;
+    ctx->queued -= res;
+  }
+}
+
+#ifdef HAVE_LIBURING
+/* Index of the registered file for fd or -1. */
+static int caml_aio_fixed_file(Context *ctx, int fd) {
+  int i;
+  for (i = 0; i < ctx->nr_reg_fds; ++i) {
+    if (ctx->reg_fds[i] == fd) return i;
+  }
+  return -1;
+}
+
+/* Index of the registered buffer containing [buf, buf + len) or -1. */
+static int caml_aio_fixed_buffer(Context *ctx, void *buf, size_t len) {
+  int i;
+  for (i = 0; i < ctx->nr_reg_bufs; ++i) {
+    char *base = ctx->reg_bufs[i].iov_base;
+    if ((char*)buf >= base
+	&& (char*)buf + len <= base + ctx->reg_bufs[i].iov_len) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Translate a prepared iocb into a sqe. Registered buffers and files
+ * are used where the request allows it.
+ */
+static void caml_aio_prep_sqe(Context *ctx, struct io_uring_sqe *sqe, struct iocb *iocb) {
+  int fd = iocb->aio_fildes;
+  void *buf = iocb->u.c.buf;
+  unsigned len = iocb->u.c.nbytes;
+  uint64_t off = iocb->u.c.offset;
+  int fixed_fd = caml_aio_fixed_file(ctx, fd);
+  int index;
+
+  if (fixed_fd >= 0) fd = fixed_fd;
+
+  switch(iocb->aio_lio_opcode) {
+  case IO_CMD_PREAD:
+    index = caml_aio_fixed_buffer(ctx, buf, len);
+    if (index >= 0) {
+      io_uring_prep_read_fixed(sqe, fd, buf, len, off, index);
+    } else {
+      io_uring_prep_read(sqe, fd, buf, len, off);
+    }
+    break;
+  case IO_CMD_PWRITE:
+    index = caml_aio_fixed_buffer(ctx, buf, len);
+    if (index >= 0) {
+      io_uring_prep_write_fixed(sqe, fd, buf, len, off, index);
+    } else {
+      io_uring_prep_write(sqe, fd, buf, len, off);
+    }
+    break;
+  case IO_CMD_PREADV:
+    io_uring_prep_readv(sqe, fd, buf, len, off);
+    break;
+  case IO_CMD_PWRITEV:
+    io_uring_prep_writev(sqe, fd, buf, len, off);
+    break;
+  case IO_CMD_FSYNC:
+    io_uring_prep_fsync(sqe, fd, 0);
+    break;
+  case IO_CMD_FDSYNC:
+    io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+    break;
+  case IO_CMD_POLL:
+    io_uring_prep_poll_add(sqe, fd, iocb->u.poll.events);
+    break;
+  }
+  if (fixed_fd >= 0) io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+  if (iocb->aio_lio_opcode == IO_CMD_PREAD || iocb->aio_lio_opcode == IO_CMD_PWRITE) {
+    sqe->rw_flags = iocb->aio_rw_flags;
+  }
+  io_uring_sqe_set_data(sqe, iocb);
+}
+
+/* Move prepared iocbs from the ring into sqes while the kernel has room
+ * for them and submit. Sqes the kernel does not take right away stay in
+ * the submission queue and go with the next io_uring_enter, errors of
+ * individual requests arrive as cqes.
+ */
+static void caml_aio_flush_uring(Context *ctx) {
+  struct io_uring_sqe *sqe;
+
+  while (ctx->queued > 0 && ctx->inflight < ctx->depth
+	 && (sqe = io_uring_get_sqe(&ctx->ring)) != NULL) {
+    caml_aio_prep_sqe(ctx, sqe, ctx->iocbs[ctx->max_ios + ctx->queue_head]);
+    caml_aio_dequeued(ctx, ctx->queue_head, 1);
+    ctx->queue_head = (ctx->queue_head + 1) % ctx->max_ios;
+    --ctx->queued;
+    ++ctx->inflight;
+  }
+  if (ctx->inflight > ctx->stats.max_inflight) {
+    ctx->stats.max_inflight = ctx->inflight;
+  }
+  if (io_uring_sq_ready(&ctx->ring) > 0) {
+    (void)io_uring_submit(&ctx->ring);
+  }
+}
+#endif
+
+/* Hand prepared iocbs to the kernel as far as the depth allows. */
+static void caml_aio_flush(Context *ctx) {
+#ifdef HAVE_LIBURING
+  if (ctx->backend == BACKEND_URING) {
+    caml_aio_flush_uring(ctx);
+    return;
+  }
+#endif
+  caml_aio_flush_libaio(ctx);
+}
+
+/* Layout of the completion ring the kernel maps at the address of an
+ * io_context_t. Not exported by any header.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+  unsigned id;
+  unsigned nr;		// number of io_events
+  unsigned head;	// advanced by whoever reaps events
+  unsigned tail;	// advanced by the kernel
+  unsigned magic;
+  unsigned compat_features;
+  unsigned incompat_features;
+  unsigned header_length;
+  struct io_event io_events[0];
+};
+
+/* Collect up to nr completed requests straight from the mapped ring
+ * without a system call. Returns -1 if the ring has an unknown layout
+ * and io_getevents must be used instead. Only safe while nobody else
+ * reaps the same io_context_t: the caller holds the runtime lock and
+ * no other thread is reaping the Context.
+ */
+static int caml_aio_ring_reap(io_context_t io_ctx, int nr, struct io_event *events) {
+  struct aio_ring *ring = (struct aio_ring*)io_ctx;
+  unsigned head, tail;
+  int n = 0;
+
+  if (ring->magic != AIO_RING_MAGIC || ring->incompat_features != 0) {
+    return -1;
+  }
+  head = ring->head % ring->nr;
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) % ring->nr;
+  while (head != tail && n < nr) {
+    events[n++] = ring->io_events[head];
+    head = (head + 1) % ring->nr;
+  }
+  // Hand the entries back to the kernel only after copying them
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* Let go of the shard lock if the calling thread holds it. Returns how
+ * often it was taken so caml_aio_relock can restore it. The mutex must
+ * be held.
+ */
+static int caml_aio_unlock_all(Context *ctx) {
+  int depth = ctx->lock_depth;
+
+  if (depth == 0 || !pthread_equal(ctx->owner, pthread_self())) return 0;
+  ctx->lock_depth = 0;
+  pthread_cond_broadcast(&ctx->unlocked);
+  return depth;
+}
+
+/* Take the shard lock back depth times once it is free. The mutex must
+ * be held and the runtime lock released.
+ */
+static void caml_aio_relock(Context *ctx, int depth) {
+  if (depth == 0) return;
+  while (ctx->lock_depth > 0) pthread_cond_wait(&ctx->unlocked, &ctx->lock);
+  ctx->owner = pthread_self();
+  ctx->lock_depth = depth;
+}
+
+/* Release the runtime lock to wait in the kernel for completions. The
+ * Context is marked as reaping meanwhile so no other thread touches
+ * the completion ring or queue. Returns the depth of the shard lock
+ * given up for caml_aio_wait_end.
+ */
+static int caml_aio_wait_begin(Context *ctx) {
+  int depth;
+
+  pthread_mutex_lock(&ctx->lock);
+  __atomic_store_n(&ctx->reaping, 1, __ATOMIC_RELAXED);
+  depth = caml_aio_unlock_all(ctx);
+  pthread_mutex_unlock(&ctx->lock);
+  caml_enter_blocking_section();
+  return depth;
+}
+
+/* Done waiting in the kernel, take the shard lock back and wake threads
+ * waiting for the reaper.
+ */
+static void caml_aio_wait_end(Context *ctx, int depth) {
+  pthread_mutex_lock(&ctx->lock);
+  caml_aio_relock(ctx, depth);
+  __atomic_store_n(&ctx->reaping, 0, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&ctx->reaped);
+  pthread_mutex_unlock(&ctx->lock);
+  caml_leave_blocking_section();
+}
+
+/* Is another thread waiting in the kernel for completions? */
+static int caml_aio_reaping(Context *ctx) {
+  return __atomic_load_n(&ctx->reaping, __ATOMIC_RELAXED);
+}
+
+/* Wait until the thread waiting in the kernel is done. The completions
+ * it collects count as progress for the caller. The shard lock is given
+ * up meanwhile, the reaper needs it back to finish.
+ */
+static void caml_aio_wait_reaper(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  int depth;
+
+  caml_enter_blocking_section();
+  pthread_mutex_lock(&ctx->lock);
+  depth = caml_aio_unlock_all(ctx);
+  while (ctx->reaping) pthread_cond_wait(&ctx->reaped, &ctx->lock);
+  caml_aio_relock(ctx, depth);
+  pthread_mutex_unlock(&ctx->lock);
+  caml_leave_blocking_section();
+
+  CAMLreturn0;
+}
+
+/* Shrink timeout to the time left until end, after an interrupted wait. */
+static void caml_aio_time_left(uint64_t end, struct timespec *timeout) {
+  uint64_t now = caml_aio_clock();
+  uint64_t left = (end > now) ? end - now : 0;
+
+  timeout->tv_sec = left / 1000000000;
+  timeout->tv_nsec = left % 1000000000;
+}
+
+#ifdef HAVE_LIBURING
+/* Is the cqe one of our requests? Cancel requests have no data and
+ * kernels without IORING_FEAT_EXT_ARG post a cqe for the timeout sqe
+ * liburing queues for a timed wait.
+ */
+static int caml_aio_cqe_is_request(struct io_uring_cqe *cqe) {
+  return cqe->user_data != 0 && cqe->user_data != LIBURING_UDATA_TIMEOUT;
+}
+#endif
+
+/* Wait for at least min_nr and collect up to nr completed requests.
+ * With io_uring the cqes are converted to io_events so the completion
+ * path is the same for both backends. The cqes of cancel requests and
+ * of liburing's timeouts are dropped. Returns the number of events or a
+ * negative errno like io_getevents. With a timeout fewer than min_nr
+ * events, even none, are returned once it expires. Waits interrupted by
+ * a signal are resumed for the rest of the timeout.
+ *
+ * Waiting releases the runtime lock so other threads keep running and
+ * may even submit more requests to this context meanwhile. The caller
+ * must keep the context alive and make sure no other thread is reaping.
+ */
+static int caml_aio_getevents(Context *ctx, int min_nr, int nr, struct io_event *events, struct timespec *timeout) {
+  uint64_t end = 0;
+  int n;
+
+  if (timeout != NULL) {
+    end = caml_aio_clock() + (uint64_t)timeout->tv_sec * 1000000000 + timeout->tv_nsec;
+  }
+#ifdef HAVE_LIBURING
+  if (ctx->backend == BACKEND_URING) {
+    struct io_uring_cqe *cqe;
+    int res, depth;
+
+    n = 0;
+    for (;;) {
+      if (n < min_nr) {
+	// Submit with the lock held, only the completion side may be used
+	// while other threads can touch the submission queue.
+	res = io_uring_submit(&ctx->ring);
+	if (res == -EAGAIN || res == -EBUSY) ++ctx->stats.eagain;
+	else if (res < 0 && res != -EINTR) return (n > 0) ? n : res;
+	do {
+	  depth = caml_aio_wait_begin(ctx);
+	  if (timeout != NULL) {
+	    struct __kernel_timespec ts = { timeout->tv_sec, timeout->tv_nsec };
+	    res = io_uring_wait_cqes(&ctx->ring, &cqe, min_nr - n, &ts, NULL);
+	  } else {
+	    res = io_uring_wait_cqe_nr(&ctx->ring, &cqe, min_nr - n);
+	  }
+	  caml_aio_wait_end(ctx, depth);
+	  if (res == -EINTR && timeout != NULL) caml_aio_time_left(end, timeout);
+	} while (res == -EINTR);
+	if (res == -ETIME) return n;
+	if (res < 0) return (n > 0) ? n : res;
+      }
+      while (n < nr) {
+	struct io_uring_cqe *cqes[32];
+	unsigned i, got;
+	got = io_uring_peek_batch_cqe(&ctx->ring, cqes,
+				      (nr - n < 32) ? nr - n : 32);
+	if (got == 0) break;
+	for (i = 0; i < got; ++i) {
+	  if (!caml_aio_cqe_is_request(cqes[i])) continue;
+	  events[n].data = NULL;
+	  events[n].obj = io_uring_cqe_get_data(cqes[i]);
+	  events[n].res = (long)cqes[i]->res;
+	  events[n].res2 = 0;
+	  ++n;
+	}
+	io_uring_cq_advance(&ctx->ring, got);
+      }
+      // Drop cqes of cancel requests and timeouts behind the last
+      // completion
+      while (io_uring_peek_cqe(&ctx->ring, &cqe) == 0
+	     && !caml_aio_cqe_is_request(cqe)) {
+	io_uring_cqe_seen(&ctx->ring, cqe);
+      }
+      // Only cqes of cancel requests or timeouts, wait again
+      if (n >= min_nr || timeout != NULL) return n;
+    }
+  }
+#endif
+  io_context_t io_ctx = ctx->ctx;
+  int res, depth;
+
+  // Take what is already in the ring, that needs no system call
+  n = caml_aio_ring_reap(io_ctx, nr, events);
+  if (n >= min_nr) return n;
+  if (n < 0) {
+    if (min_nr == 0) return io_getevents(io_ctx, 0, nr, events, NULL);
+    n = 0;
+  }
+  do {
+    depth = caml_aio_wait_begin(ctx);
+    res = io_getevents(io_ctx, min_nr - n, nr - n, events + n, timeout);
+    caml_aio_wait_end(ctx, depth);
+    if (res == -EINTR && timeout != NULL) caml_aio_time_left(end, timeout);
+  } while (res == -EINTR);
+  if (res < 0) return (n > 0) ? n : res;
+  return n + res;
+}
+
+/* Move requests from the overflow list into free slots and submit. */
+static void caml_aio_refill(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  CAMLlocal1(ml_node);
+  Context *ctx = Context_val(ml_ctx);
+
+  while (ctx->overflow > 0 && ctx->pending < ctx->max_ios) {
+    ml_node = Field(ml_ctx, Overflow_head(ctx));
+    Store_field(ml_ctx, Overflow_head(ctx), Field(ml_node, 1));
+    if (--ctx->overflow == 0) {
+      Store_field(ml_ctx, Overflow_tail(ctx), Val_unit);
+    }
+    caml_aio_prep_cmd(ml_ctx, Field(ml_node, 0), Int_val(Field(ml_node, 2)));
+    ctx = Context_val(ml_ctx);
+    if (Field(ml_node, 3) != Val_unit) {
+      caml_aio_tag(ctx, Field(ml_node, 3), Long_val(Field(ml_node, 4)));
+    }
+  }
+  caml_aio_flush(ctx);
+
+  CAMLreturn0;
+}
+
+/* read: fun ctx fd fd_off buf fn -> ()
+external read : context -> Unix.file_descr -> int64 -> Buffer.t ->
+                (result -> unit) -> unit = "caml_aio_read"
+*/
+CAMLprim value caml_aio_read(value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffer, value ml_fn) {
+  CAMLparam5(ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_fn);
+  //fprintf(stderr, "### caml_aio_read()\n");
+  value ml_len = Val_long(Bigarray_val(ml_buffer)->dim[0]);
+
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_rw(ml_ctx, IO_CMD_PREAD, ml_fd, ml_fd_off, ml_buffer,
+		     Val_int(0), ml_len, ml_fn, 0);
+  } else {
+    caml_aio_overflow_push(ml_ctx,
+      caml_aio_make_rw(CMD_READ, ml_fd, ml_fd_off, ml_buffer,
+		       Val_int(0), ml_len, ml_fn));
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* Prepare a pread/pwrite with RWF_* flags or put it on the overflow
+ * list if there is no free slot, then submit.
+ */
+static void caml_aio_rw(int tag, value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn, int flags) {
+  CAMLparam5(ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_buf_off);
+  CAMLxparam2(ml_len, ml_fn);
+
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_rw(ml_ctx, tag == CMD_READ ? IO_CMD_PREAD : IO_CMD_PWRITE,
+		     ml_fd, ml_fd_off, ml_buffer, ml_buf_off, ml_len, ml_fn, flags);
+  } else {
+    caml_aio_check_range(ml_buffer, ml_buf_off, ml_len);
+    caml_aio_overflow_push_flags(ml_ctx,
+      caml_aio_make_rw(tag, ml_fd, ml_fd_off, ml_buffer,
+		       ml_buf_off, ml_len, ml_fn), flags);
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn0;
+}
+
+/* Flags for read_flags/write_flags in the order of Aio.rw_flag */
+static int caml_aio_rw_flag_table[] = {
+  RWF_HIPRI, RWF_DSYNC, RWF_SYNC, RWF_NOWAIT,
+};
+
+/* read_sub: fun ctx fd fd_off buf buf_off len fn -> ()
+external read_sub : context -> Unix.file_descr -> int64 -> Buffer.t ->
+                    int -> int -> (result -> unit) -> unit =
+  "caml_aio_read_sub_bytecode" "caml_aio_read_sub"
+*/
+CAMLprim value caml_aio_read_sub(value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn) {
+  //fprintf(stderr, "### caml_aio_read_sub()\n");
+  caml_aio_rw(CMD_READ, ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_buf_off,
+	      ml_len, ml_fn, 0);
+  return Val_unit;
+}
+
+CAMLprim value caml_aio_read_sub_bytecode(value *argv, int argn) {
+  (void)argn;
+  return caml_aio_read_sub(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+/* read_multiple: fun ctx [|(fd, fd_off, buf, fn)|] -> ()
+external read_multiple : context ->
+                         (Unix.file_descr * int64 * Buffer.t * (result -> unit)) array ->
+                         unit = "caml_aio_read_multiple"
+*/
+CAMLprim value caml_aio_read_multiple(value ml_ctx, value read_cmds) {
+  CAMLparam2(ml_ctx, read_cmds);
+  CAMLlocal2(read_cmd, ml_buffer);
+  int len = Wosize_val(read_cmds);
+  int i;
+
+  for (i = 0; i < len; i++) {
+    read_cmd = Field(read_cmds, i);
+    ml_buffer = Field(read_cmd, 2);
+    value ml_len = Val_long(Bigarray_val(ml_buffer)->dim[0]);
+    if (caml_aio_has_slot(Context_val(ml_ctx))) {
+      caml_aio_prep_rw(ml_ctx, IO_CMD_PREAD, Field(read_cmd, 0), Field(read_cmd, 1),
+		       ml_buffer, Val_int(0), ml_len, Field(read_cmd, 3), 0);
+    } else {
+      caml_aio_overflow_push(ml_ctx,
+	caml_aio_make_rw(CMD_READ, Field(read_cmd, 0), Field(read_cmd, 1),
+			 ml_buffer, Val_int(0), ml_len, Field(read_cmd, 3)));
+    }
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* read_multiple_sub: fun ctx [|(fd, fd_off, buf, buf_off, len, fn)|] -> ()
+external read_multiple_sub : context ->
+                             (Unix.file_descr * int64 * Buffer.t * int * int *
+                              (result -> unit)) array ->
+                             unit = "caml_aio_read_multiple_sub"
+*/
+CAMLprim value caml_aio_read_multiple_sub(value ml_ctx, value read_cmds) {
+  CAMLparam2(ml_ctx, read_cmds);
+  CAMLlocal1(read_cmd);
+  int len = Wosize_val(read_cmds);
+  int i;
+
+  for (i = 0; i < len; i++) {
+    read_cmd = Field(read_cmds, i);
+    caml_aio_check_range(Field(read_cmd, 2), Field(read_cmd, 3), Field(read_cmd, 4));
+  }
+
+  for (i = 0; i < len; i++) {
+    read_cmd = Field(read_cmds, i);
+    if (caml_aio_has_slot(Context_val(ml_ctx))) {
+      caml_aio_prep_rw(ml_ctx, IO_CMD_PREAD, Field(read_cmd, 0), Field(read_cmd, 1),
+		       Field(read_cmd, 2), Field(read_cmd, 3), Field(read_cmd, 4),
+		       Field(read_cmd, 5), 0);
+    } else {
+      caml_aio_overflow_push(ml_ctx,
+	caml_aio_make_rw(CMD_READ, Field(read_cmd, 0), Field(read_cmd, 1),
+			 Field(read_cmd, 2), Field(read_cmd, 3), Field(read_cmd, 4),
+			 Field(read_cmd, 5)));
+    }
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* write: fun ctx fd fd_off buf fn -> ()
+external write : context -> Unix.file_descr -> int64 -> buffer ->
+                 (result -> unit) -> unit = "caml_aio_write"
+*/
+CAMLprim value caml_aio_write(value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffer, value ml_fn) {
+  CAMLparam5(ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_fn);
+  //fprintf(stderr, "### caml_aio_write()\n");
+  value ml_len = Val_long(Bigarray_val(ml_buffer)->dim[0]);
+
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_rw(ml_ctx, IO_CMD_PWRITE, ml_fd, ml_fd_off, ml_buffer,
+		     Val_int(0), ml_len, ml_fn, 0);
+  } else {
+    caml_aio_overflow_push(ml_ctx,
+      caml_aio_make_rw(CMD_WRITE, ml_fd, ml_fd_off, ml_buffer,
+		       Val_int(0), ml_len, ml_fn));
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* write_sub: fun ctx fd fd_off buf buf_off len fn -> ()
+external write_sub : context -> Unix.file_descr -> int64 -> Buffer.t ->
+                     int -> int -> (result -> unit) -> unit =
+  "caml_aio_write_sub_bytecode" "caml_aio_write_sub"
+*/
+CAMLprim value caml_aio_write_sub(value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn) {
+  //fprintf(stderr, "### caml_aio_write_sub()\n");
+  caml_aio_rw(CMD_WRITE, ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_buf_off,
+	      ml_len, ml_fn, 0);
+  return Val_unit;
+}
+
+CAMLprim value caml_aio_write_sub_bytecode(value *argv, int argn) {
+  (void)argn;
+  return caml_aio_write_sub(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6]);
+}
+
+/* read_flags: fun ctx flags fd fd_off buf buf_off len fn -> ()
+external read_flags : context -> rw_flag list -> Unix.file_descr -> int64 ->
+                      Buffer.t -> int -> int -> (result -> unit) -> unit =
+  "caml_aio_read_flags_bytecode" "caml_aio_read_flags"
+*/
+CAMLprim value caml_aio_read_flags(value ml_ctx, value ml_flags, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn) {
+  //fprintf(stderr, "### caml_aio_read_flags()\n");
+  int flags = caml_convert_flag_list(ml_flags, caml_aio_rw_flag_table);
+  caml_aio_rw(CMD_READ, ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_buf_off,
+	      ml_len, ml_fn, flags);
+  return Val_unit;
+}
+
+CAMLprim value caml_aio_read_flags_bytecode(value *argv, int argn) {
+  (void)argn;
+  return caml_aio_read_flags(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
+}
+
+/* write_flags: fun ctx flags fd fd_off buf buf_off len fn -> ()
+external write_flags : context -> rw_flag list -> Unix.file_descr -> int64 ->
+                       Buffer.t -> int -> int -> (result -> unit) -> unit =
+  "caml_aio_write_flags_bytecode" "caml_aio_write_flags"
+*/
+CAMLprim value caml_aio_write_flags(value ml_ctx, value ml_flags, value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len, value ml_fn) {
+  //fprintf(stderr, "### caml_aio_write_flags()\n");
+  int flags = caml_convert_flag_list(ml_flags, caml_aio_rw_flag_table);
+  caml_aio_rw(CMD_WRITE, ml_ctx, ml_fd, ml_fd_off, ml_buffer, ml_buf_off,
+	      ml_len, ml_fn, flags);
+  return Val_unit;
+}
+
+CAMLprim value caml_aio_write_flags_bytecode(value *argv, int argn) {
+  (void)argn;
+  return caml_aio_write_flags(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7]);
+}
+
+/* Build the command for a preadv/pwritev that has to wait for a slot. */
+static value caml_aio_make_vec(int tag, value ml_fd, value ml_fd_off, value ml_buffers, value ml_fn) {
+  CAMLparam4(ml_fd, ml_fd_off, ml_buffers, ml_fn);
+  CAMLlocal1(ml_cmd);
+
+  ml_cmd = caml_alloc(4, tag);
+  Store_field(ml_cmd, 0, ml_fd);
+  Store_field(ml_cmd, 1, ml_fd_off);
+  Store_field(ml_cmd, 2, ml_buffers);
+  Store_field(ml_cmd, 3, ml_fn);
+
+  CAMLreturn(ml_cmd);
+}
+
+/* readv: fun ctx fd fd_off bufs fn -> ()
+external readv : context -> Unix.file_descr -> int64 -> Buffer.t array ->
+                 (vresult -> unit) -> unit = "caml_aio_readv"
+*/
+CAMLprim value caml_aio_readv(value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffers, value ml_fn) {
+  CAMLparam5(ml_ctx, ml_fd, ml_fd_off, ml_buffers, ml_fn);
+  //fprintf(stderr, "### caml_aio_readv()\n");
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_vec(ml_ctx, IO_CMD_PREADV, ml_fd, ml_fd_off, ml_buffers, ml_fn);
+  } else {
+    caml_aio_check_vec(ml_buffers);
+    caml_aio_overflow_push(ml_ctx,
+      caml_aio_make_vec(CMD_READV, ml_fd, ml_fd_off, ml_buffers, ml_fn));
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* writev: fun ctx fd fd_off bufs fn -> ()
+external writev : context -> Unix.file_descr -> int64 -> Buffer.t array ->
+                  (vresult -> unit) -> unit = "caml_aio_writev"
+*/
+CAMLprim value caml_aio_writev(value ml_ctx, value ml_fd, value ml_fd_off, value ml_buffers, value ml_fn) {
+  CAMLparam5(ml_ctx, ml_fd, ml_fd_off, ml_buffers, ml_fn);
+  //fprintf(stderr, "### caml_aio_writev()\n");
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_vec(ml_ctx, IO_CMD_PWRITEV, ml_fd, ml_fd_off, ml_buffers, ml_fn);
+  } else {
+    caml_aio_check_vec(ml_buffers);
+    caml_aio_overflow_push(ml_ctx,
+      caml_aio_make_vec(CMD_WRITEV, ml_fd, ml_fd_off, ml_buffers, ml_fn));
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* Prepare a fsync/fdatasync or put it on the overflow list if there
+ * is no free slot, then submit.
+ */
+static void caml_aio_sync(int tag, value ml_ctx, value ml_fd, value ml_fn) {
+  CAMLparam3(ml_ctx, ml_fd, ml_fn);
+  CAMLlocal1(ml_cmd);
+
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_sync(ml_ctx, tag == CMD_FSYNC ? IO_CMD_FSYNC : IO_CMD_FDSYNC,
+		       ml_fd, ml_fn);
+  } else {
+    ml_cmd = caml_alloc_small(2, tag);
+    Field(ml_cmd, 0) = ml_fd;
+    Field(ml_cmd, 1) = ml_fn;
+    caml_aio_overflow_push(ml_ctx, ml_cmd);
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn0;
+}
+
+/* fsync: fun ctx fd fn -> ()
+external fsync : context -> Unix.file_descr -> (unit completion -> unit) -> unit = "caml_aio_fsync"
+*/
+CAMLprim value caml_aio_fsync(value ml_ctx, value ml_fd, value ml_fn) {
+  //fprintf(stderr, "### caml_aio_fsync()\n");
+  caml_aio_sync(CMD_FSYNC, ml_ctx, ml_fd, ml_fn);
+  return Val_unit;
+}
+
+/* fdatasync: fun ctx fd fn -> ()
+external fdatasync : context -> Unix.file_descr -> (unit completion -> unit) -> unit = "caml_aio_fdatasync"
+*/
+CAMLprim value caml_aio_fdatasync(value ml_ctx, value ml_fd, value ml_fn) {
+  //fprintf(stderr, "### caml_aio_fdatasync()\n");
+  caml_aio_sync(CMD_FDSYNC, ml_ctx, ml_fd, ml_fn);
+  return Val_unit;
+}
+
+/* submit: fun ctx cmds -> ()
+external submit : context -> command array -> unit = "caml_aio_submit"
+*/
+CAMLprim value caml_aio_submit(value ml_ctx, value ml_cmds) {
+  CAMLparam2(ml_ctx, ml_cmds);
+  CAMLlocal1(ml_cmd);
+  int len = Wosize_val(ml_cmds);
+  int i;
+  //fprintf(stderr, "### caml_aio_submit()\n");
+
+  // Check all commands first so nothing is left half submitted
+  for (i = 0; i < len; i++) {
+    caml_aio_check_cmd(Field(ml_cmds, i));
+  }
+
+  for (i = 0; i < len; i++) {
+    ml_cmd = Field(ml_cmds, i);
+    if (caml_aio_has_slot(Context_val(ml_ctx))) {
+      caml_aio_prep_cmd(ml_ctx, ml_cmd, 0);
+    } else {
+      caml_aio_overflow_push(ml_ctx, ml_cmd);
+    }
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* poll: fun ctx fd events fn -> ()
+external poll : context -> Unix.file_descr -> poll_event list -> (poll_event list completion -> unit) -> unit = "caml_aio_poll"
+*/
+CAMLprim value caml_aio_poll(value ml_ctx, value ml_fd, value ml_events, value ml_fn) {
+  CAMLparam4(ml_ctx, ml_fd, ml_events, ml_fn);
+  CAMLlocal1(ml_cmd);
+  //fprintf(stderr, "### caml_aio_poll()\n");
+
+  if (caml_aio_has_slot(Context_val(ml_ctx))) {
+    caml_aio_prep_poll(ml_ctx, ml_fd, ml_events, ml_fn);
+  } else {
+    ml_cmd = caml_alloc_small(3, CMD_POLL);
+    Field(ml_cmd, 0) = ml_fd;
+    Field(ml_cmd, 1) = ml_events;
+    Field(ml_cmd, 2) = ml_fn;
+    caml_aio_overflow_push(ml_ctx, ml_cmd);
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(Val_unit);
+}
+
+/* timerfd_create: fun () -> fd
+external create : unit -> t = "caml_aio_timerfd_create"
+*/
+CAMLprim value caml_aio_timerfd_create(value ml_unit) {
+  CAMLparam1(ml_unit);
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (fd == -1) caml_aio_raise_error(errno);
+
+  CAMLreturn(Val_int(fd));
+}
+
+static void caml_aio_timespec(double t, struct timespec *ts) {
+  ts->tv_sec = (time_t)t;
+  ts->tv_nsec = (long)((t - ts->tv_sec) * 1e9);
+}
+
+/* timerfd_set: fun fd delay interval -> ()
+external set_timer : t -> float -> float -> unit = "caml_aio_timerfd_set"
+
+A delay of 0 or less expires right away instead of disarming the timer.
+*/
+CAMLprim value caml_aio_timerfd_set(value ml_fd, value ml_delay, value ml_interval) {
+  CAMLparam3(ml_fd, ml_delay, ml_interval);
+  struct itimerspec its;
+  double delay = Double_val(ml_delay);
+  double interval = Double_val(ml_interval);
+
+  caml_aio_timespec(interval > 0.0 ? interval : 0.0, &its.it_interval);
+  caml_aio_timespec(delay > 0.0 ? delay : 0.0, &its.it_value);
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+    its.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(Int_val(ml_fd), 0, &its, NULL) == -1) {
+    caml_aio_raise_error(errno);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/* timerfd_disarm: fun fd -> ()
+external disarm : t -> unit = "caml_aio_timerfd_disarm"
+*/
+CAMLprim value caml_aio_timerfd_disarm(value ml_fd) {
+  CAMLparam1(ml_fd);
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (timerfd_settime(Int_val(ml_fd), 0, &its, NULL) == -1) {
+    caml_aio_raise_error(errno);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/* timerfd_read: fun fd -> int
+external expirations : t -> int = "caml_aio_timerfd_read"
+
+Number of expirations since the last call, 0 if none.
+*/
+CAMLprim value caml_aio_timerfd_read(value ml_fd) {
+  CAMLparam1(ml_fd);
+  uint64_t n;
+  ssize_t res = read(Int_val(ml_fd), &n, sizeof(n));
+
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) CAMLreturn(Val_int(0));
+    caml_aio_raise_error(errno);
+  }
+  // A timerfd hands out all 8 bytes or none, errno means nothing here
+  if (res != sizeof(n)) caml_failwith("Aio.Timer.expirations: Short read from timerfd.");
+
+  CAMLreturn(Val_long(n));
+}
+
+/* Record the completion of a tagged request in the done array. */
+static void caml_aio_push_done(Context *ctx, value ml_cookie, long res, long res2) {
+  struct io_event *ev;
+
+  if (ctx->nr_done == ctx->done_max) {
+    if (ctx->done_head > 0) {
+      // Reuse the room of entries reaped already
+      memmove(ctx->done, ctx->done + ctx->done_head,
+	      (ctx->nr_done - ctx->done_head) * sizeof(struct io_event));
+      ctx->nr_done -= ctx->done_head;
+      ctx->done_head = 0;
+    } else {
+      int max = (ctx->done_max > 0) ? 2 * ctx->done_max : ctx->max_ios;
+      struct io_event *done = realloc(ctx->done, max * sizeof(struct io_event));
+      // FIXME: throw exception
+      assert(done);
+      ctx->done = done;
+      ctx->done_max = max;
+    }
+  }
+  ev = &ctx->done[ctx->nr_done++];
+  ev->data = (void*)Long_val(ml_cookie);
+  ev->obj = NULL;
+  ev->res = res;
+  ev->res2 = res2;
+}
+
+/* Remove callback and buffer of a finished request and free its iocb. */
+static void caml_aio_release(value ml_ctx, struct iocb *iocb) {
+  Context *ctx = Context_val(ml_ctx);
+  intptr_t slot = (intptr_t)iocb->data;
+  Slot *s = &ctx->slots[slot / 2];
+
+  --ctx->pending;
+  caml_aio_timer_remove(ctx, slot);
+  caml_remove_generational_global_root(&s->fn);
+  caml_remove_generational_global_root(&s->buf);
+  s->fn = Val_unit;
+  s->buf = Val_unit;
+  s->live = 0;
+  s->id = 0;
+  ctx->iocbs[ctx->pending] = iocb;
+}
+
+/* Call the continuation of a request with an error. */
+static void caml_aio_call_error(Context *ctx, value ml_fn, int err) {
+  static const value * call_error = NULL;
+
+  // Tagged request, leave it for reap
+  if (Is_long(ml_fn)) {
+    caml_aio_push_done(ctx, ml_fn, -err, 0);
+    return;
+  }
+  if (call_error == NULL) {
+    /* First time around, look up by name */
+    call_error = caml_named_value("caml_aio_call_error");
+  }
+  caml_callback2(*call_error, ml_fn, Val_int(err));
+}
+
+/* Call the continuation of a poll with the ready events as a bit mask
+ * in the order of the Aio.poll_event constructors.
+ */
+static void caml_aio_call_poll(value ml_fn, long revents) {
+  static const value * call_poll = NULL;
+  unsigned i;
+  int mask = 0;
+
+  for (i = 0; i < NR_POLL_EVENTS; ++i) {
+    if (revents & poll_event_table[i]) mask |= 1 << i;
+  }
+  if (call_poll == NULL) {
+    /* First time around, look up by name */
+    call_poll = caml_named_value("caml_aio_call_poll");
+  }
+  caml_callback2(*call_poll, ml_fn, Val_int(mask));
+}
+
+/* Free the slot of a completed request and call its continuation.
+ * The callback may submit new requests and even trigger a GC so the
+ * Context must be looked up again afterwards. Tagged requests only
+ * record the outcome and allocate nothing. Cancelled requests had
+ * their continuation called already.
+ */
+static void caml_aio_complete(value ml_ctx, struct iocb *iocb, long res, long res2) {
+  CAMLparam1(ml_ctx);
+  CAMLlocal2(ml_fn, ml_buf);
+  static const value * call_result  = NULL;
+  static const value * call_partial = NULL;
+  Context *ctx = Context_val(ml_ctx);
+  intptr_t slot = (intptr_t)iocb->data;
+  size_t len = ctx->slots[slot / 2].len;
+  int cancelled = ctx->slots[slot / 2].cancelled;
+  int opcode = iocb->aio_lio_opcode;
+  //fprintf(stderr, "### caml_aio_complete(): slot = %"PRIdPTR"\n", slot);
+
+  caml_aio_count(ctx, iocb, ctx->slots[slot / 2].start, len, res, res2);
+
+  // Get callback and buffer
+  ml_fn = ctx->slots[slot / 2].fn;
+  ml_buf = ctx->slots[slot / 2].buf;
+
+  caml_aio_release(ml_ctx, iocb);
+  if (cancelled) CAMLreturn0;
+
+  // Tagged request, leave it for reap
+  if (Is_long(ml_fn)) {
+    caml_aio_push_done(ctx, ml_fn, res, res2);
+    CAMLreturn0;
+  }
+
+  // Execute callback
+  if (res2 != 0 || res < 0) {
+    caml_aio_call_error(ctx, ml_fn, res < 0 ? -res : res2);
+  } else if (opcode == IO_CMD_POLL) {
+    // No buffer, the result is the mask of ready events
+    caml_aio_call_poll(ml_fn, res);
+  } else if ((size_t)res != len) {
+    if (call_partial == NULL) {
+      /* First time around, look up by name */
+      call_partial = caml_named_value("caml_aio_call_partial");
+    }
+    caml_callback3(*call_partial, ml_fn, ml_buf, Val_long(res));
+  } else {
+    if (call_result == NULL) {
+      /* First time around, look up by name */
+      call_result = caml_named_value("caml_aio_call_result");
+    }
+    caml_callback2(*call_result, ml_fn, ml_buf);
+  }
+
+  CAMLreturn0;
+}
+
+/* Call the continuations of requests the kernel refused. */
+static void caml_aio_complete_failed(value ml_ctx) {
+  Context *ctx = Context_val(ml_ctx);
+
+  if (ctx->failed != 0) ctx->now = caml_aio_clock();
+  while (ctx->failed != 0) {
+    Slot *s = &ctx->slots[ctx->failed / 2];
+    ctx->failed = s->next;
+    caml_aio_complete(ml_ctx, s->iocb, -s->err, 0);
+    ctx = Context_val(ml_ctx);
+  }
+}
+
+/* Cancel the request in slot and call its continuation with err right
+ * away. A request still in the ring of prepared iocbs is taken out and
+ * never reaches the kernel. Otherwise the kernel is asked to drop the
+ * iocb but buffer and slot stay taken until it lets go of it. The
+ * completion then only frees the slot.
+ */
+static void caml_aio_cancel_slot(value ml_ctx, intptr_t slot, int err) {
+  CAMLparam1(ml_ctx);
+  CAMLlocal1(ml_fn);
+  Context *ctx = Context_val(ml_ctx);
+  Slot *s = &ctx->slots[slot / 2];
+  struct iocb *iocb = s->iocb;
+
+  ml_fn = s->fn;
+  ctx->now = caml_aio_clock();
+  caml_aio_timer_remove(ctx, slot);
+
+  if (s->queued) {
+    caml_aio_unqueue(ctx, iocb);
+    caml_aio_count(ctx, iocb, s->start, s->len, -err, 0);
+    caml_aio_release(ml_ctx, iocb);
+    caml_aio_call_error(ctx, ml_fn, err);
+    CAMLreturn0;
+  }
+
+  s->cancelled = 1;
+  caml_modify_generational_global_root(&s->fn, Val_unit);
+
+#ifdef HAVE_LIBURING
+  if (ctx->backend == BACKEND_URING) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ctx->ring);
+    // Best effort, the request finishes on its own otherwise
+    if (sqe != NULL) {
+      io_uring_prep_cancel(sqe, iocb, 0);
+      io_uring_sqe_set_data(sqe, NULL);
+      (void)io_uring_submit(&ctx->ring);
+    }
+  } else
+#endif
+  {
+    struct io_event event;
+    // Old kernels hand the completion back right here, newer ones post
+    // it to the ring and return EINPROGRESS. Requests not in the kernel
+    // or not cancellable fail with EINVAL or EAGAIN.
+    if (io_cancel(ctx->ctx, iocb, &event) == 0) {
+      --ctx->inflight;
+      caml_aio_count(ctx, iocb, s->start, s->len, -err, 0);
+      caml_aio_release(ml_ctx, iocb);
+    }
+  }
+
+  caml_aio_call_error(ctx, ml_fn, err);
+
+  CAMLreturn0;
+}
+
+/* Cancel requests whose deadline passed with ETIMEDOUT. Returns the
+ * number of requests cancelled.
+ */
+static int caml_aio_expire(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  uint64_t now;
+  int n = 0;
+
+  if (ctx->nr_timers == 0) CAMLreturnT(int, 0);
+  now = caml_aio_clock();
+  while (ctx->nr_timers > 0 && ctx->timers[0].when <= now) {
+    // Completed and cancelled requests drop their deadline, so the
+    // top of the heap always belongs to a live request
+    caml_aio_cancel_slot(ml_ctx, ctx->timers[0].slot, ETIMEDOUT);
+    ctx = Context_val(ml_ctx);
+    ++n;
+  }
+
+  CAMLreturnT(int, n);
+}
+
+/* start: fun ctx cmd timeout -> request
+external start_cmd : context -> command -> int -> request = "caml_aio_start"
+*/
+CAMLprim value caml_aio_start(value ml_ctx, value ml_cmd, value ml_timeout) {
+  CAMLparam3(ml_ctx, ml_cmd, ml_timeout);
+  CAMLlocal1(ml_req);
+  //fprintf(stderr, "### caml_aio_start()\n");
+  Context *ctx = Context_val(ml_ctx);
+  intnat timeout = Long_val(ml_timeout);
+  uint64_t deadline = (timeout > 0) ? caml_aio_clock() + timeout : 0;
+
+  caml_aio_check_cmd(ml_cmd);
+  // { id; slot }, the slot is 0 while the request waits for one
+  ml_req = caml_alloc_small(2, 0);
+  Field(ml_req, 0) = Val_long(++Context_val(ml_ctx)->last_id);
+  Field(ml_req, 1) = Val_long(0);
+  ctx = Context_val(ml_ctx);
+  if (caml_aio_has_slot(ctx)) {
+    caml_aio_prep_cmd(ml_ctx, ml_cmd, 0);
+    caml_aio_tag(Context_val(ml_ctx), ml_req, deadline);
+  } else {
+    caml_aio_overflow_push_req(ml_ctx, ml_cmd, 0, ml_req, deadline);
+  }
+  caml_aio_flush(Context_val(ml_ctx));
+
+  CAMLreturn(ml_req);
+}
+
+/* Cancel a request still waiting for a slot: unlink it from the
+ * overflow list and call its continuation. Returns 0 if it isn't there.
+ */
+static int caml_aio_cancel_overflow(value ml_ctx, value ml_req) {
+  CAMLparam2(ml_ctx, ml_req);
+  CAMLlocal3(ml_node, ml_prev, ml_cmd);
+  Context *ctx = Context_val(ml_ctx);
+
+  ml_prev = Val_unit;
+  ml_node = (ctx->overflow > 0) ? Field(ml_ctx, Overflow_head(ctx)) : Val_unit;
+  while (ml_node != Val_unit && Field(ml_node, 3) != ml_req) {
+    ml_prev = ml_node;
+    ml_node = Field(ml_node, 1);
+  }
+  if (ml_node == Val_unit) CAMLreturnT(int, 0);
+
+  if (ml_prev == Val_unit) {
+    Store_field(ml_ctx, Overflow_head(ctx), Field(ml_node, 1));
+  } else {
+    Store_field(ml_prev, 1, Field(ml_node, 1));
+  }
+  if (--ctx->overflow == 0) {
+    Store_field(ml_ctx, Overflow_tail(ctx), Val_unit);
+  } else if (Field(ml_node, 1) == Val_unit) {
+    Store_field(ml_ctx, Overflow_tail(ctx), ml_prev);
+  }
+
+  // The continuation is the last field of every command
+  ml_cmd = Field(ml_node, 0);
+  caml_aio_call_error(ctx, Field(ml_cmd, Wosize_val(ml_cmd) - 1), ECANCELED);
+
+  CAMLreturnT(int, 1);
+}
+
+/* cancel: fun ctx request -> bool
+external cancel : context -> request -> bool = "caml_aio_cancel"
+*/
+CAMLprim value caml_aio_cancel(value ml_ctx, value ml_req) {
+  CAMLparam2(ml_ctx, ml_req);
+  //fprintf(stderr, "### caml_aio_cancel()\n");
+  Context *ctx = Context_val(ml_ctx);
+  intnat id = Long_val(Field(ml_req, 0));
+  intptr_t slot = Long_val(Field(ml_req, 1));
+  Slot *s;
+
+  if (slot == 0) {
+    CAMLreturn(Val_bool(caml_aio_cancel_overflow(ml_ctx, ml_req)));
+  }
+  // The slot may hold a later request by now
+  if (slot < 0 || slot / 2 >= ctx->max_ios) CAMLreturn(Val_false);
+  s = &ctx->slots[slot / 2];
+  if (s->id != id || s->cancelled) CAMLreturn(Val_false);
+  caml_aio_cancel_slot(ml_ctx, slot, ECANCELED);
+
+  CAMLreturn(Val_true);
+}
+
+/* errno values of cancelled and timed out requests */
+CAMLprim value caml_aio_ecanceled(value ml_unit) {
+  (void)ml_unit;
+  return Val_int(ECANCELED);
+}
+
+CAMLprim value caml_aio_etimedout(value ml_unit) {
+  (void)ml_unit;
+  return Val_int(ETIMEDOUT);
+}
+
+/* run: fun ctx -> ()
+external run : context -> unit = "caml_aio_run"
+*/
+CAMLprim value caml_aio_run(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  //fprintf(stderr, "### caml_aio_run()\n");
+  uint64_t num;
+
+  while(Context_val(ml_ctx)->pending > 0) {
+    // Another thread collects the completions, let it
+    if (caml_aio_reaping(Context_val(ml_ctx))) {
+      caml_aio_wait_reaper(ml_ctx);
+      continue;
+    }
+    caml_aio_complete_failed(ml_ctx);
+    caml_aio_expire(ml_ctx);
+    caml_aio_refill(ml_ctx);
+
+    Context *ctx = Context_val(ml_ctx);
+    if (ctx->inflight == 0) {
+      if (ctx->failed != 0) continue;
+      if (ctx->pending == 0) break;
+      // Nothing in flight to wait for and the kernel refuses more
+      caml_aio_raise_error(EAGAIN);
+    }
+
+    struct io_event events[ctx->inflight];
+    struct io_event *ep;
+    struct timespec ts;
+    int n;
+
+    // Wait for at least one event or the next deadline
+    n = caml_aio_getevents(ctx, 1, ctx->inflight, events, caml_aio_timeout(ctx, &ts));
+    //fprintf(stderr, "### caml_aio_run(): n = %d\n", n);
+    if (n < 0) caml_aio_raise_error(-n);
+    ctx->inflight -= n;
+    ctx->now = caml_aio_clock();
+
+    // process callbacks
+    for(ep = events; n-- > 0; ep++) {
+      caml_aio_complete(ml_ctx, ep->obj, (long)ep->res, (long)ep->res2);
+    }
+  }
+  // Clear eventfd
+  // FIXME: throw exception
+  (void)read(Context_val(ml_ctx)->fd, &num, sizeof(num));
+
+  //fprintf(stderr, "### caml_aio_run(): done\n");
+  CAMLreturn(Val_unit);
+}
+
+/* Complete failed requests and up to max finished ones, waiting for at
+ * least min_nr of them, then move waiting requests into the freed slots.
+ */
+static void caml_aio_reap(value ml_ctx, int min_nr, uint64_t max) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+
+  // Another thread waits in the kernel and collects the completions.
+  // Blocking callers wait for it instead, the others leave them to it.
+  if (caml_aio_reaping(ctx)) {
+    if (min_nr > 0) caml_aio_wait_reaper(ml_ctx);
+    CAMLreturn0;
+  }
+
+  // Completing refused requests is progress enough, don't wait then
+  if (ctx->failed != 0) min_nr = 0;
+  caml_aio_complete_failed(ml_ctx);
+  if (caml_aio_expire(ml_ctx) > 0) min_nr = 0;
+
+  ctx = Context_val(ml_ctx);
+  if (ctx->inflight > 0) {
+    int nr = (max < (uint64_t)ctx->inflight) ? (int)max : ctx->inflight;
+    struct io_event events[nr];
+    struct io_event *ep;
+    struct timespec ts;
+    int n;
+
+    // Failed requests bump the eventfd too so don't insist on any.
+    n = caml_aio_getevents(ctx, min_nr, nr, events,
+			   min_nr > 0 ? caml_aio_timeout(ctx, &ts) : NULL);
+    //fprintf(stderr, "### caml_aio_reap(): n = %d\n", n);
+    if (n < 0) caml_aio_raise_error(-n);
+    ctx->inflight -= n;
+    if (n > 0) ctx->now = caml_aio_clock();
+
+    // process callbacks
+    for(ep = events; n-- > 0; ep++) {
+      caml_aio_complete(ml_ctx, ep->obj, (long)ep->res, (long)ep->res2);
+    }
+    // Deadlines that passed while waiting
+    caml_aio_expire(ml_ctx);
+  }
+
+  // Completions freed slots, move waiting requests up
+  caml_aio_refill(ml_ctx);
+
+  CAMLreturn0;
+}
+
+/* process: fun ctx -> ()
+external process : context -> unit = "caml_aio_process"
+*/
+CAMLprim value caml_aio_process(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  //fprintf(stderr, "### caml_aio_process()\n");
+  Context *ctx = Context_val(ml_ctx);
+  uint64_t num;
+
+  int ret = read(ctx->fd, &num, sizeof(num));
+
+  // io_uring bumps the eventfd once for a whole batch of cqes, so the
+  // counter only says something completed. Drain the completion queue.
+  if (ctx->backend == BACKEND_URING) {
+    caml_aio_reap(ml_ctx, 0, UINT64_MAX);
+    CAMLreturn(Val_unit);
+  }
+
+  if (ret == 0 || (ret == -1 &&
+                   (errno == EWOULDBLOCK ||
+                    errno == EAGAIN))
+      || num == 0)
+    CAMLreturn(Val_unit);
+
+  // FIXME: throw exception
+  assert(ret == sizeof(num));
+
+  // Collect the events the eventfd told us about
+  caml_aio_reap(ml_ctx, 0, num);
+
+  //fprintf(stderr, "### caml_aio_process(): done\n");
+  CAMLreturn(Val_unit);
+}
+
+/* step: fun ctx -> ()
+external step : context -> unit = "caml_aio_step"
+*/
+CAMLprim value caml_aio_step(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  //fprintf(stderr, "### caml_aio_step()\n");
+  Context *ctx = Context_val(ml_ctx);
+
+  if (ctx->pending == 0) CAMLreturn(Val_unit);
+  if (ctx->inflight == 0 && ctx->failed == 0) {
+    caml_aio_refill(ml_ctx);
+    ctx = Context_val(ml_ctx);
+    // Nothing in flight to wait for and the kernel refuses more
+    if (ctx->inflight == 0 && ctx->failed == 0) caml_aio_raise_error(EAGAIN);
+  }
+  caml_aio_reap(ml_ctx, 1, UINT64_MAX);
+
+  //fprintf(stderr, "### caml_aio_step(): done\n");
+  CAMLreturn(Val_unit);
+}
+
+/* process_nowait: fun ctx -> ()
+external process_nowait : context -> unit = "caml_aio_process_nowait"
+*/
+CAMLprim value caml_aio_process_nowait(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  //fprintf(stderr, "### caml_aio_process_nowait()\n");
+  Context *ctx = Context_val(ml_ctx);
+
+  // Nothing can be ready, don't bother
+  if (ctx->failed == 0 && ctx->inflight == 0 && ctx->queued == 0)
+    CAMLreturn(Val_unit);
+
+  // Reap straight from the completion ring and leave the eventfd alone
+  caml_aio_reap(ml_ctx, 0, UINT64_MAX);
+
+  //fprintf(stderr, "### caml_aio_process_nowait(): done\n");
+  CAMLreturn(Val_unit);
+}
+
+/* reap: fun ctx arr wait -> int
+external reap_array : context -> int array -> bool -> int = "caml_aio_reap_array"
+*/
+CAMLprim value caml_aio_reap_array(value ml_ctx, value ml_arr, value ml_wait) {
+  CAMLparam3(ml_ctx, ml_arr, ml_wait);
+  //fprintf(stderr, "### caml_aio_reap_array()\n");
+  Context *ctx = Context_val(ml_ctx);
+  int max = Wosize_val(ml_arr) / 3;
+  int n;
+
+  // Only go to the kernel if the done array can't fill arr
+  if (ctx->nr_done - ctx->done_head < max
+      && (ctx->failed != 0 || ctx->inflight != 0 || ctx->queued != 0)) {
+    int min_nr = (Bool_val(ml_wait) && ctx->nr_done == ctx->done_head
+		  && ctx->inflight > 0) ? 1 : 0;
+    caml_aio_reap(ml_ctx, min_nr, UINT64_MAX);
+    ctx = Context_val(ml_ctx);
+  }
+
+  // Ints need no write barrier
+  for (n = 0; n < max && ctx->done_head < ctx->nr_done; ++n) {
+    struct io_event *ev = &ctx->done[ctx->done_head++];
+    Field(ml_arr, 3 * n) = Val_long((intptr_t)ev->data);
+    Field(ml_arr, 3 * n + 1) = Val_long((long)ev->res);
+    Field(ml_arr, 3 * n + 2) = Val_long((long)ev->res2);
+  }
+  if (ctx->done_head == ctx->nr_done) {
+    ctx->done_head = 0;
+    ctx->nr_done = 0;
+  }
+
+  CAMLreturn(Val_int(n));
+}
+
+/* get_done: fun ctx -> int
+external get_done : context -> int = "caml_aio_get_done"
+ */
+CAMLprim value caml_aio_get_done(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->nr_done - ctx->done_head));
+}
+
+/* fd: fun ctx -> Unix.file_descr
+external fd : context -> fd = "caml_aio_fd"
+*/
+CAMLprim value caml_aio_fd(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);    
+  CAMLreturn(Val_int(ctx->fd));
+}
+
+/* get_pending: fun ctx -> int
+external get_pending : context -> int = "caml_aio_get_pending"
+ */
+CAMLprim value caml_aio_get_pending(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->pending + ctx->overflow));
+}
+
+/* get_queued: fun ctx -> int
+external get_queued : context -> int = "caml_aio_get_queued"
+ */
+CAMLprim value caml_aio_get_queued(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->queued + ctx->overflow));
+}
+
+/* get_max_queued: fun ctx -> int
+external get_max_queued : context -> int = "caml_aio_get_max_queued"
+ */
+CAMLprim value caml_aio_get_max_queued(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->max_queued));
+}
+
+/* get_overflowed: fun ctx -> int
+external get_overflowed : context -> int = "caml_aio_get_overflowed"
+ */
+CAMLprim value caml_aio_get_overflowed(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->overflowed));
+}
+
+/* stats: fun ctx -> stats
+external stats : context -> stats = "caml_aio_stats"
+ */
+CAMLprim value caml_aio_stats(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  CAMLlocal2(ml_stats, ml_hist);
+  Stats *st = &Context_val(ml_ctx)->stats;
+  int kind, i;
+
+  ml_stats = caml_alloc_tuple(8 + NR_KINDS);
+  Store_field(ml_stats, 0, Val_long(st->submitted));
+  Store_field(ml_stats, 1, Val_long(st->completed));
+  Store_field(ml_stats, 2, Val_long(st->partial));
+  Store_field(ml_stats, 3, Val_long(st->errors));
+  Store_field(ml_stats, 4, Val_long(st->eagain));
+  Store_field(ml_stats, 5, Val_long(st->bytes_read));
+  Store_field(ml_stats, 6, Val_long(st->bytes_written));
+  Store_field(ml_stats, 7, Val_int(st->max_inflight));
+  for (kind = 0; kind < NR_KINDS; ++kind) {
+    ml_hist = caml_alloc_tuple(NR_BUCKETS);
+    for (i = 0; i < NR_BUCKETS; ++i) {
+      Field(ml_hist, i) = Val_long(st->latency[kind][i]);
+    }
+    Store_field(ml_stats, 8 + kind, ml_hist);
+  }
+
+  CAMLreturn(ml_stats);
+}
+
+/* reset_stats: fun ctx -> ()
+external reset_stats : context -> unit = "caml_aio_reset_stats"
+ */
+CAMLprim value caml_aio_reset_stats(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->stats.max_inflight = ctx->inflight;
+  CAMLreturn(Val_unit);
+}
+
+/* lock: fun ctx -> ()
+external lock : context -> unit = "caml_aio_lock"
+
+The lock of a context used by Aio.Sharded. Without it parallel domains
+would change the same Context. The holding thread may take it again.
+Waiting for it releases the runtime lock.
+ */
+CAMLprim value caml_aio_lock(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  pthread_t self = pthread_self();
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->lock_depth > 0 && !pthread_equal(ctx->owner, self)) {
+    pthread_mutex_unlock(&ctx->lock);
+    caml_enter_blocking_section();
+    pthread_mutex_lock(&ctx->lock);
+    caml_aio_relock(ctx, 1);
+    pthread_mutex_unlock(&ctx->lock);
+    caml_leave_blocking_section();
+    CAMLreturn(Val_unit);
+  }
+  ctx->owner = self;
+  ++ctx->lock_depth;
+  pthread_mutex_unlock(&ctx->lock);
+
+  CAMLreturn(Val_unit);
+}
+
+/* try_lock: fun ctx -> bool
+external try_lock : context -> bool = "caml_aio_try_lock" "noalloc"
+
+Take the lock of the context only if that needs no waiting.
+ */
+CAMLprim value caml_aio_try_lock(value ml_ctx) {
+  Context *ctx = Context_val(ml_ctx);
+  pthread_t self = pthread_self();
+  int ok = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->lock_depth == 0 || pthread_equal(ctx->owner, self)) {
+    ctx->owner = self;
+    ++ctx->lock_depth;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return Val_bool(ok);
+}
+
+/* unlock: fun ctx -> ()
+external unlock : context -> unit = "caml_aio_unlock" "noalloc"
+ */
+CAMLprim value caml_aio_unlock(value ml_ctx) {
+  Context *ctx = Context_val(ml_ctx);
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->lock_depth > 0 && pthread_equal(ctx->owner, pthread_self())
+      && --ctx->lock_depth == 0) {
+    pthread_cond_broadcast(&ctx->unlocked);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return Val_unit;
+}
+
+/* domain_id: fun () -> int
+external domain_id : unit -> int = "caml_aio_domain_id" "noalloc"
+
+Id of the calling domain, always 0 before OCaml 5.
+ */
+CAMLprim value caml_aio_domain_id(value ml_unit) {
+  (void)ml_unit;
+#if OCAML_VERSION_MAJOR >= 5
+  return Val_int(Caml_state->id);
+#else
+  return Val_int(0);
+#endif
+}
+
+/* pin_cpu: fun cpu -> ()
+external pin_cpu : int -> unit = "caml_aio_pin_cpu"
+ */
+CAMLprim value caml_aio_pin_cpu(value ml_cpu) {
+  CAMLparam1(ml_cpu);
+  int cpu = Int_val(ml_cpu);
+  cpu_set_t set;
+
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    caml_invalid_argument("Aio.Sharded: Invalid cpu.");
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  // Only the calling thread
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    caml_aio_raise_error(errno);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+/* get_depth: fun ctx -> int
+external get_depth : context -> int = "caml_aio_get_depth"
+ */
+CAMLprim value caml_aio_get_depth(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->depth));
+}
+
+/* set_depth: fun ctx depth -> ()
+external set_depth : context -> int -> unit = "caml_aio_set_depth"
+ */
+CAMLprim value caml_aio_set_depth(value ml_ctx, value ml_depth) {
+  CAMLparam2(ml_ctx, ml_depth);
+  Context *ctx = Context_val(ml_ctx);
+  int depth = Int_val(ml_depth);
+
+  if (depth <= 0) {
+    caml_invalid_argument("Aio.set_depth: depth must be positive.");
+  }
+  ctx->depth = (depth < ctx->max_ios) ? depth : ctx->max_ios;
+  caml_aio_flush(ctx);
+
+  CAMLreturn(Val_unit);
+}
+
+/* get_backend: fun ctx -> int
+external get_backend : context -> int = "caml_aio_get_backend"
+ */
+CAMLprim value caml_aio_get_backend(value ml_ctx) {
+  CAMLparam1(ml_ctx);
+  Context *ctx = Context_val(ml_ctx);
+  CAMLreturn(Val_int(ctx->backend));
+}
+
+/* register_buffers: fun ctx bufs -> ()
+external register_buffers : context -> Buffer.t array -> unit = "caml_aio_register_buffers"
+ */
+CAMLprim value caml_aio_register_buffers(value ml_ctx, value ml_buffers) {
+  CAMLparam2(ml_ctx, ml_buffers);
+  Context *ctx = Context_val(ml_ctx);
+
+  if (ctx->backend != BACKEND_URING) CAMLreturn(Val_unit);
+#ifdef HAVE_LIBURING
+  int nr = Wosize_val(ml_buffers);
+  struct iovec *iov = NULL;
+  int i, res;
+
+  if (ctx->pending > 0) caml_aio_raise_error(EBUSY);
+  if (nr > 0) {
+    iov = malloc(nr * sizeof(struct iovec));
+    if (iov == NULL) caml_aio_raise_error(ENOMEM);
+    for (i = 0; i < nr; ++i) {
+      iov[i].iov_base = Data_bigarray_val(Field(ml_buffers, i));
+      iov[i].iov_len = Bigarray_val(Field(ml_buffers, i))->dim[0];
+    }
+  }
+  if (ctx->nr_reg_bufs > 0) {
+    (void)io_uring_unregister_buffers(&ctx->ring);
+    free(ctx->reg_bufs);
+    ctx->reg_bufs = NULL;
+    ctx->nr_reg_bufs = 0;
+    Store_field(ml_ctx, Registered_buffers(ctx), Val_unit);
+  }
+  if (nr > 0) {
+    res = io_uring_register_buffers(&ctx->ring, iov, nr);
+    if (res < 0) {
+      free(iov);
+      caml_aio_raise_error(-res);
+    }
+    ctx->reg_bufs = iov;
+    ctx->nr_reg_bufs = nr;
+    // Keep the buffers alive while the kernel has them pinned
+    Store_field(ml_ctx, Registered_buffers(ctx), ml_buffers);
+  }
+#endif
+  CAMLreturn(Val_unit);
+}
+
+/* register_files: fun ctx fds -> ()
+external register_files : context -> Unix.file_descr array -> unit = "caml_aio_register_files"
+ */
+CAMLprim value caml_aio_register_files(value ml_ctx, value ml_fds) {
+  CAMLparam2(ml_ctx, ml_fds);
+  Context *ctx = Context_val(ml_ctx);
+
+  if (ctx->backend != BACKEND_URING) CAMLreturn(Val_unit);
+#ifdef HAVE_LIBURING
+  int nr = Wosize_val(ml_fds);
+  int *fds = NULL;
+  int i, res;
+
+  if (ctx->pending > 0) caml_aio_raise_error(EBUSY);
+  if (nr > 0) {
+    fds = malloc(nr * sizeof(int));
+    if (fds == NULL) caml_aio_raise_error(ENOMEM);
+    for (i = 0; i < nr; ++i) {
+      fds[i] = Int_val(Field(ml_fds, i));
+    }
+  }
+  if (ctx->nr_reg_fds > 0) {
+    (void)io_uring_unregister_files(&ctx->ring);
+    free(ctx->reg_fds);
+    ctx->reg_fds = NULL;
+    ctx->nr_reg_fds = 0;
+  }
+  if (nr > 0) {
+    res = io_uring_register_files(&ctx->ring, fds, nr);
+    if (res < 0) {
+      free(fds);
+      caml_aio_raise_error(-res);
+    }
+    ctx->reg_fds = fds;
+    ctx->nr_reg_fds = nr;
+  }
+#endif
+  CAMLreturn(Val_unit);
+}
+
+
+/* set_direct: fun fd -> ()
+external set_direct : Unix.file_descr -> unit = "caml_aio_set_direct"
+ */
+CAMLprim value caml_aio_set_direct(value ml_fd) {
+  CAMLparam1(ml_fd);
+  int fd = Int_val(ml_fd);
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+    caml_aio_raise_error(errno);
+  }
+  CAMLreturn(Val_unit);
+}
+
+/* dio_align: fun fd -> (mem_align, offset_align)
+external dio_align : Unix.file_descr -> int * int = "caml_aio_dio_align"
+ */
+CAMLprim value caml_aio_dio_align(value ml_fd) {
+  CAMLparam1(ml_fd);
+  CAMLlocal1(ml_res);
+  int fd = Int_val(ml_fd);
+  struct stat st;
+  int mem_align, offset_align;
+
+  if (fstat(fd, &st) == -1) caml_aio_raise_error(errno);
+  // Fall back to the preferred block size, usually stricter than needed
+  mem_align = offset_align = st.st_blksize;
+  if (S_ISBLK(st.st_mode)) {
+    int bsz;
+    if (ioctl(fd, BLKSSZGET, &bsz) == -1) caml_aio_raise_error(errno);
+    mem_align = offset_align = bsz;
+  } else {
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+	&& (stx.stx_mask & STATX_DIOALIGN)) {
+      // The file system can't do direct I/O on this file
+      if (stx.stx_dio_offset_align == 0) caml_aio_raise_error(EINVAL);
+      offset_align = stx.stx_dio_offset_align;
+      // Keep the fallback if no memory alignment is reported
+      if (stx.stx_dio_mem_align != 0) mem_align = stx.stx_dio_mem_align;
+    }
+#endif
+  }
+
+  ml_res = caml_alloc_tuple(2);
+  Store_field(ml_res, 0, Val_int(mem_align));
+  Store_field(ml_res, 1, Val_int(offset_align));
+  CAMLreturn(ml_res);
+}
+
+/* Does a transfer of len bytes between file offset fd_off and the
+ * buffer at buf_off fit the alignment of the Aio.File.t? An alignment
+ * of 0 is no constraint.
+ */
+static int caml_aio_dio_fits(value ml_file, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len) {
+  uintptr_t mem_align = Long_val(Field(ml_file, 1));
+  uint64_t offset_align = Long_val(Field(ml_file, 2));
+  uintptr_t addr = (uintptr_t)Data_bigarray_val(ml_buffer) + Long_val(ml_buf_off);
+
+  return (mem_align == 0 || addr % mem_align == 0)
+    && (offset_align == 0
+	|| ((uint64_t)Int64_val(ml_fd_off) % offset_align == 0
+	    && (uint64_t)Long_val(ml_len) % offset_align == 0));
+}
+
+/* dio_aligned: fun file fd_off buf buf_off len -> bool
+external dio_aligned : t -> int64 -> Buffer.t -> int -> int -> bool = "caml_aio_dio_aligned" "noalloc"
+ */
+value caml_aio_dio_aligned(value ml_file, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len) {
+  return Val_bool(caml_aio_dio_fits(ml_file, ml_fd_off, ml_buffer, ml_buf_off, ml_len));
+}
+
+/* dio_check: fun file fd_off buf buf_off len -> ()
+external dio_check : t -> int64 -> Buffer.t -> int -> int -> unit = "caml_aio_dio_check"
+ */
+CAMLprim value caml_aio_dio_check(value ml_file, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_len) {
+  CAMLparam5(ml_file, ml_fd_off, ml_buffer, ml_buf_off, ml_len);
+  caml_aio_check_range(ml_buffer, ml_buf_off, ml_len);
+  if (!caml_aio_dio_fits(ml_file, ml_fd_off, ml_buffer, ml_buf_off, ml_len)) {
+    caml_aio_raise_error(EINVAL);
+  }
+  CAMLreturn(Val_unit);
+}
+
+/* sync_read: fun fd fd_off buf -> unit
+external sync_read : Unix.file_descr -> int64 -> buffer -> unit = "caml_aio_sync_read"
+*/
+CAMLprim value caml_aio_sync_read(value ml_fd, value ml_fd_off, value ml_buffer) {
+  CAMLparam3(ml_fd, ml_fd_off, ml_buffer);
+  //fprintf(stderr, "### caml_aio_sync_read()\n");
+  int fd = Int_val(ml_fd);
+  uint64_t fd_off = Int64_val(ml_fd_off);
+  void *buf = Data_bigarray_val(ml_buffer);
+  size_t len = Bigarray_val(ml_buffer)->dim[0];
+
+  ssize_t res = pread(fd, buf, len, fd_off);
+  // FIXME: throw exception on error
+  assert(res >= 0 && (size_t)res == len);
+  CAMLreturn(Val_unit);
+}
+
+/* sync_write: fun fd fd_off buf buf_off buf_len -> int
+external sync_write : Unix.file_descr -> int64 -> buffer -> int -> int -> int = "caml_aio_sync_write"
+*/
+CAMLprim value caml_aio_sync_write(value ml_fd, value ml_fd_off, value ml_buffer, value ml_buf_off, value ml_buf_len) {
+  CAMLparam5(ml_fd, ml_fd_off, ml_buffer, ml_buf_off, ml_buf_len);
+  //fprintf(stderr, "### caml_aio_sync_write()\n");
+  int fd = Int_val(ml_fd);
+  uint64_t fd_off = Int64_val(ml_fd_off);
+  void *buf = Data_bigarray_val(ml_buffer);
+  size_t len = Bigarray_val(ml_buffer)->dim[0];
+
+  ssize_t res = pwrite(fd, buf, len, fd_off);
+  // FIXME: throw exception on error
+  assert(res >= 0 && (size_t)res == len);
+  CAMLreturn(Val_int(len));
+}
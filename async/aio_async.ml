@@ -0,0 +1,107 @@
+(* aio_async.ml: Async integration for libaio-ocaml
+ * Copyright (C) 2026 The libaio-ocaml contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * Under Debian a copy can be found in /usr/share/common-licenses/LGPL-2.1.
+ *)
+
+open Core
+open Async
+
+type t = {
+  ctx : Aio.context;
+  fd : Fd.t;
+  stop : unit Ivar.t;
+  waiters : int Or_error.t Ivar.t Aio.Cookies.t;
+}
+
+(* Filler for unused cookies, never filled *)
+let nobody = Ivar.create ()
+
+let error err = Error (Error.of_exn (Aio.Error err))
+
+let fill ivar = function
+    Aio.Result n -> Ivar.fill ivar (Ok n)
+  | Aio.Partial (_, n) -> Ivar.fill ivar (Ok n)
+  | Aio.Errno err -> Ivar.fill ivar (error err)
+
+(* Fill the ivars of all completed requests *)
+let drain t = Aio.Cookies.drain t.waiters fill
+
+let create ?depth ?backend ?batch max_ios =
+  let ctx = Aio.context ?depth ?backend max_ios in
+  let t = {
+    ctx = ctx;
+    fd = Fd.create Fd.Kind.Fifo (Aio.fd ctx) (Info.of_string "aio eventfd");
+    stop = Ivar.create ();
+    waiters = Aio.Cookies.create ?batch ctx nobody;
+  }
+  in
+    don't_wait_for
+      (Deferred.ignore_m
+	 (Fd.every_ready_to ~stop:(Ivar.read t.stop) t.fd `Read drain t));
+    t
+
+let context t = t.ctx
+
+let close t = Ivar.fill_if_empty t.stop ()
+
+let read t fd off buf buf_off len =
+  let ivar = Ivar.create ()
+  in
+    Aio.Cookies.read t.waiters fd off buf buf_off len ivar;
+    Ivar.read ivar
+
+let write t fd off buf buf_off len =
+  let ivar = Ivar.create ()
+  in
+    Aio.Cookies.write t.waiters fd off buf buf_off len ivar;
+    Ivar.read ivar
+
+(* Vectored and sync requests have no tagged form and keep a
+ * continuation *)
+let fill_vec ivar = function
+    Aio.Result bufs ->
+      Ivar.fill ivar
+	(Ok (Array.fold bufs ~init:0 ~f:(fun acc b -> acc + Aio.Buffer.length b)))
+  | Aio.Partial (_, n) -> Ivar.fill ivar (Ok n)
+  | Aio.Errno err -> Ivar.fill ivar (error err)
+
+let fill_sync ivar = function
+    Aio.Errno err -> Ivar.fill ivar (error err)
+  | _ -> Ivar.fill ivar (Ok ())
+
+let readv t fd off bufs =
+  let ivar = Ivar.create ()
+  in
+    Aio.readv t.ctx fd off bufs (fill_vec ivar);
+    Ivar.read ivar
+
+let writev t fd off bufs =
+  let ivar = Ivar.create ()
+  in
+    Aio.writev t.ctx fd off bufs (fill_vec ivar);
+    Ivar.read ivar
+
+let fsync t fd =
+  let ivar = Ivar.create ()
+  in
+    Aio.fsync t.ctx fd (fill_sync ivar);
+    Ivar.read ivar
+
+let fdatasync t fd =
+  let ivar = Ivar.create ()
+  in
+    Aio.fdatasync t.ctx fd (fill_sync ivar);
+    Ivar.read ivar
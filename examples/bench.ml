@@ -0,0 +1,284 @@
+(* fio style benchmark of the Aio bindings
+ *
+ * Every combination of method, access pattern, block size, queue depth
+ * and read percentage runs for a fixed time against one file. One line
+ * per run is printed as JSON (or CSV with -csv).
+ *)
+
+let file = ref "benchfile"
+let size_mb = ref 256
+let seconds = ref 2.0
+let methods = ref "sync,aio,batch"
+let patterns = ref "seq,rand"
+let block_sizes = ref "4096,65536"
+let depths = ref "1,4,16,64"
+let mixes = ref "100,70,0"
+let direct = ref false
+let uring = ref false
+let csv = ref false
+
+let split conv s = List.map conv (String.split_on_char ',' s)
+
+type run = {
+  meth : string;
+  pattern : string;
+  bs : int;
+  qd : int;
+  read_pct : int;
+}
+
+(* Latencies of all I/Os of a run in seconds *)
+let lat = ref (Array.make 65536 0.0)
+let nr_lat = ref 0
+
+let record t =
+  if !nr_lat = Array.length !lat
+  then begin
+    let a = Array.make (2 * !nr_lat) 0.0
+    in
+      Array.blit !lat 0 a 0 !nr_lat;
+      lat := a
+  end;
+  !lat.(!nr_lat) <- t;
+  incr nr_lat
+
+let percentile sorted p =
+  let n = Array.length sorted
+  in
+    if n = 0
+    then 0.0
+    else sorted.(min (n - 1) (int_of_float (p *. float_of_int n)))
+
+(* Offsets of the next I/Os of a run *)
+let next_offset run blocks =
+  let pos = ref 0
+  in
+    fun () ->
+      let block =
+	if run.pattern = "rand"
+	then Random.int blocks
+	else begin
+	  let b = !pos in pos := (b + 1) mod blocks; b
+	end
+      in
+	Int64.mul (Int64.of_int block) (Int64.of_int run.bs)
+
+let is_read run = run.read_pct = 100 || Random.int 100 < run.read_pct
+
+(* Blocking pread/pwrite, one I/O at a time *)
+let bench_sync run fd blocks stop =
+  let buf = Aio.Buffer.create run.bs in
+  let next = next_offset run blocks
+  in
+    while Unix.gettimeofday () < stop do
+      let off = next () in
+      let start = Unix.gettimeofday ()
+      in
+	if is_read run
+	then Aio.sync_read fd off buf
+	else Aio.sync_write fd off buf;
+	record (Unix.gettimeofday () -. start)
+    done
+
+(* qd requests in flight, each completion submits the next one *)
+let bench_aio run ctx fd blocks stop =
+  let next = next_offset run blocks in
+  let rec submit buf =
+    let start = Unix.gettimeofday () in
+    let cont res =
+      let now = Unix.gettimeofday ()
+      in
+	ignore (Aio.result res);
+	record (now -. start);
+	if now < stop then submit buf
+    in
+      if is_read run
+      then Aio.read ctx fd (next ()) buf cont
+      else Aio.write ctx fd (next ()) buf cont
+  in
+    for _i = 1 to run.qd do
+      submit (Aio.Buffer.create run.bs)
+    done;
+    Aio.run ctx
+
+(* Batches of qd requests submitted together and waited for. Pure
+ * reads go through read_multiple, mixes through submit. Each request
+ * is timed from when it was prepared to its own completion. *)
+let bench_batch run ctx fd blocks stop =
+  let next = next_offset run blocks in
+  let bufs = Array.init run.qd (fun _ -> Aio.Buffer.create run.bs) in
+  let timed () =
+    let start = Unix.gettimeofday ()
+    in
+      fun res ->
+	ignore (Aio.result res);
+	record (Unix.gettimeofday () -. start)
+  in
+    while Unix.gettimeofday () < stop do
+      if run.read_pct = 100
+      then
+	Aio.read_multiple ctx
+	  (Array.map (fun buf -> (fd, next (), buf, timed ())) bufs)
+      else
+	Aio.submit ctx
+	  (Array.map
+	     (fun buf ->
+		if is_read run
+		then Aio.Read (fd, next (), buf, 0, run.bs, timed ())
+		else Aio.Write (fd, next (), buf, 0, run.bs, timed ()))
+	     bufs);
+      Aio.run ctx
+    done
+
+let print run ops elapsed cpu =
+  let sorted = Array.sub !lat 0 !nr_lat in
+  let () = Array.sort compare sorted in
+  let us p = 1e6 *. percentile sorted p in
+  let iops = float_of_int ops /. elapsed in
+  let mbps = iops *. float_of_int run.bs /. 1048576.0 in
+  let cpu_us = if ops = 0 then 0.0 else 1e6 *. cpu /. float_of_int ops
+  in
+    if !csv
+    then
+      Printf.printf "%s,%s,%d,%d,%d,%d,%.3f,%.1f,%.2f,%.1f,%.1f,%.1f,%.2f\n"
+	run.meth run.pattern run.bs run.qd run.read_pct ops elapsed
+	iops mbps (us 0.5) (us 0.99) (us 0.999) cpu_us
+    else
+      Printf.printf
+	"{\"method\": \"%s\", \"pattern\": \"%s\", \"bs\": %d, \"qd\": %d, \
+	 \"read_pct\": %d, \"ops\": %d, \"seconds\": %.3f, \"iops\": %.1f, \
+	 \"mib_per_s\": %.2f, \"lat_p50_us\": %.1f, \"lat_p99_us\": %.1f, \
+	 \"lat_p999_us\": %.1f, \"cpu_us_per_io\": %.2f}\n"
+	run.meth run.pattern run.bs run.qd run.read_pct ops elapsed
+	iops mbps (us 0.5) (us 0.99) (us 0.999) cpu_us;
+    flush stdout
+
+(* One context per queue depth, shared by all runs with that depth *)
+let contexts = Hashtbl.create 8
+
+let context qd =
+  try
+    Hashtbl.find contexts qd
+  with Not_found ->
+    let ctx =
+      if !uring
+      then Aio.context ~backend:Aio.Io_uring qd
+      else Aio.context qd
+    in
+      Hashtbl.add contexts qd ctx;
+      ctx
+
+let bench run fd size =
+  let blocks = Int64.to_int (Int64.div size (Int64.of_int run.bs)) in
+  let t0 = Unix.times () in
+  let start = Unix.gettimeofday () in
+  let stop = start +. !seconds
+  in
+    nr_lat := 0;
+    (match run.meth with
+       "sync" -> bench_sync run fd blocks stop
+     | "aio" -> bench_aio run (context run.qd) fd blocks stop
+     | "batch" -> bench_batch run (context run.qd) fd blocks stop
+     | m -> invalid_arg ("unknown method " ^ m));
+    let elapsed = Unix.gettimeofday () -. start in
+    let t1 = Unix.times () in
+    let cpu =
+      t1.Unix.tms_utime -. t0.Unix.tms_utime
+      +. t1.Unix.tms_stime -. t0.Unix.tms_stime
+    in
+      print run !nr_lat elapsed cpu
+
+(* Fill a regular file up to size so reads never come up short.
+ * Devices are used as they are. *)
+let prepare fd size =
+  let chunk = 1024 * 1024 in
+  let buf = Aio.Buffer.create chunk in
+  let st = Unix.LargeFile.fstat fd in
+  let cur =
+    if st.Unix.LargeFile.st_kind = Unix.S_REG
+    then st.Unix.LargeFile.st_size
+    else size
+  in
+    Aio.Buffer.fill buf 0 chunk 0xa5;
+    let rec loop off =
+      if off < size
+      then begin
+	Aio.sync_write fd off buf;
+	loop (Int64.add off (Int64.of_int chunk))
+      end
+    in
+      loop (Int64.mul (Int64.div cur (Int64.of_int chunk)) (Int64.of_int chunk))
+
+let usage = "bench [options]"
+
+(* Parse a list option and check every element *)
+let checked name conv ok s =
+  List.map
+    (fun x ->
+       let v = try conv x with Failure _ -> raise (Arg.Bad (name ^ ": " ^ x)) in
+	 if not (ok v) then raise (Arg.Bad (name ^ ": " ^ x));
+	 v)
+    (split (fun s -> s) s)
+
+let () =
+  let spec = [
+    ("-file", Arg.Set_string file, "path file or device to test on (benchfile)");
+    ("-size", Arg.Set_int size_mb, "mb size of the test file (256)");
+    ("-time", Arg.Set_float seconds, "s duration of each run (2.0)");
+    ("-methods", Arg.Set_string methods, "list sync,aio,batch");
+    ("-patterns", Arg.Set_string patterns, "list seq,rand");
+    ("-bs", Arg.Set_string block_sizes, "list block sizes (4096,65536)");
+    ("-qd", Arg.Set_string depths, "list queue depths (1,4,16,64)");
+    ("-mix", Arg.Set_string mixes, "list read percentages (100,70,0)");
+    ("-direct", Arg.Set direct, " open the file with O_DIRECT");
+    ("-uring", Arg.Set uring, " use the io_uring backend");
+    ("-csv", Arg.Set csv, " print CSV instead of JSON lines");
+  ]
+  in
+  let () = Arg.parse spec (fun arg -> raise (Arg.Bad arg)) usage in
+  let page = Aio.Buffer.page_size () in
+  let size = Int64.mul (Int64.of_int !size_mb) 1048576L in
+  let (meths, pats, bss, qds, mixs) =
+    try
+      if !size_mb <= 0 then raise (Arg.Bad "-size must be positive");
+      if !seconds <= 0.0 then raise (Arg.Bad "-time must be positive");
+      (checked "-methods" (fun s -> s)
+	 (fun m -> List.mem m ["sync"; "aio"; "batch"]) !methods,
+       checked "-patterns" (fun s -> s)
+	 (fun p -> p = "seq" || p = "rand") !patterns,
+       (* Buffers are page aligned, a block is at least one page so
+	  O_DIRECT works and at most the whole file so there is one *)
+       checked "-bs" int_of_string
+	 (fun bs -> bs > 0 && bs mod page = 0 && Int64.of_int bs <= size)
+	 !block_sizes,
+       checked "-qd" int_of_string (fun qd -> qd > 0) !depths,
+       checked "-mix" int_of_string (fun m -> m >= 0 && m <= 100) !mixes)
+    with Arg.Bad msg ->
+      Printf.eprintf "bench: bad argument %s\n" msg;
+      Arg.usage spec usage;
+      exit 2
+  in
+  let fd = Unix.openfile !file [Unix.O_RDWR; Unix.O_CREAT] 0o644 in
+  (* Turn on O_DIRECT first so prepare doesn't leave the file in the
+     page cache *)
+  let fd = if !direct then Aio.File.fd (Aio.File.of_fd fd) else fd
+  in
+    prepare fd size;
+    if !csv
+    then print_endline "method,pattern,bs,qd,read_pct,ops,seconds,iops,mib_per_s,lat_p50_us,lat_p99_us,lat_p999_us,cpu_us_per_io";
+    List.iter (fun meth ->
+	List.iter (fun pattern ->
+	  List.iter (fun bs ->
+	    List.iter (fun read_pct ->
+	      (* The sync method has no queue *)
+	      let qds = if meth = "sync" then [1] else qds
+	      in
+		List.iter (fun qd ->
+		  bench { meth = meth; pattern = pattern; bs = bs; qd = qd;
+			  read_pct = read_pct } fd size)
+		  qds)
+	      mixs)
+	    bss)
+	  pats)
+	meths;
+    Unix.close fd
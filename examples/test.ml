@@ -1,3 +1,295 @@
+(* The checks below print nothing unless they fail, so test.out only
+ * holds the output of the write/read test at the end. *)
+let check name ok =
+  if not ok
+  then begin
+    Printf.printf "FAILED: %s\n" name;
+    exit 1
+  end
+
+(* Known vectors of CRC32C and XXH64, also at an odd offset *)
+let test_checksums () =
+  let page = Aio.Buffer.page_size () in
+  let buf = Aio.Buffer.create page in
+  let crc = Aio.Buffer.crc32c and xxh = Aio.Buffer.xxhash64
+  in
+    Aio.Buffer.blit_from_string "123456789" 0 buf 0 9;
+    check "crc32c 123456789" (crc buf 0 9 = 0xe3069283);
+    check "crc32c continued" (crc ~crc:(crc buf 0 4) buf 4 5 = 0xe3069283);
+    Aio.Buffer.fill buf 0 32 0;
+    check "crc32c 32 zeros" (crc buf 0 32 = 0x8a9136aa);
+    Aio.Buffer.blit_from_string "abc" 0 buf 1 3;
+    check "xxhash64 empty" (xxh buf 0 0 = 0xef46db3751d8e999L);
+    check "xxhash64 abc" (xxh buf 1 3 = 0x44bc2cf5ad770999L);
+    for i = 0 to 99 do Aio.Buffer.set_uint8 buf (i + 1) i done;
+    check "crc32c 0..99" (crc buf 1 100 = 0xc1caebe5);
+    check "xxhash64 0..99" (xxh buf 1 100 = 0x6ac1e58032166597L);
+    check "xxhash64 0..99 seed" (xxh ~seed:42L buf 1 100 = 0x819d2b726001d507L)
+
+(* More requests than slots wait in the context instead of failing *)
+let test_overflow () =
+  let page = Aio.Buffer.page_size () in
+  let fd = Unix.openfile "testfile.aio" [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o664 in
+  let ctx = Aio.context 4 in
+  let n = 16 in
+  let ok = ref 0
+  in
+    for i = 0 to n - 1 do
+      let buf = Aio.Buffer.create page
+      in
+	Aio.Buffer.fill buf 0 page i;
+	Aio.write ctx fd (Int64.of_int (i * page)) buf
+	  (function Aio.Result _ -> incr ok | _ -> ())
+    done;
+    check "overflow pending" (Aio.get_pending ctx = n);
+    check "overflow queued" (Aio.get_overflowed ctx = n - 4);
+    Aio.run ctx;
+    check "overflow completed" (!ok = n);
+    let buf = Aio.Buffer.create page
+    in
+      for i = 0 to n - 1 do
+	Aio.sync_read fd (Int64.of_int (i * page)) buf;
+	check "overflow data"
+	  (Aio.Buffer.get_uint8 buf 0 = i && Aio.Buffer.get_uint8 buf (page - 1) = i)
+      done;
+      Unix.close fd;
+      Unix.unlink "testfile.aio"
+
+(* Records committed while a batch is written go out together in the
+ * next one, and every committer hears back in commit order *)
+let test_wal () =
+  let fd = Unix.openfile "testfile.wal" [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o664 in
+  let ctx = Aio.context 8 in
+  let wal = Aio.Wal.create ~align:512 ctx fd in
+  let n = 10 in
+  let record i = Printf.sprintf "record %d\n" i in
+  let done_ = ref [] in
+  let sum = Array.fold_left ( + ) 0
+  in
+    for i = 0 to n - 1 do
+      let r = record i
+      in
+	Aio.Wal.commit_string wal r 0 (String.length r)
+	  (function
+	       Aio.Result () -> done_ := i :: !done_
+	     | _ -> check "wal completion" false)
+    done;
+    Aio.Wal.wait wal;
+    check "wal order" (List.rev !done_ = List.init n (fun i -> i));
+    let st = Aio.stats ctx in
+    let expect = String.concat "" (List.init n record)
+    in
+      check "wal batches" (sum st.Aio.write_latency = 2);
+      check "wal syncs" (sum st.Aio.sync_latency = 2);
+      check "wal offset" (Aio.Wal.offset wal = Int64.of_int (String.length expect));
+      let bytes = Bytes.create (String.length expect)
+      in
+	check "wal read"
+	  (Unix.read fd bytes 0 (Bytes.length bytes) = Bytes.length bytes);
+	check "wal data" (Bytes.to_string bytes = expect);
+	Unix.close fd;
+	Unix.unlink "testfile.wal"
+
+(* Cancel requests waiting for a slot, waiting in the context and in
+ * the kernel, and let a deadline cancel one *)
+let test_cancel () =
+  let page = Aio.Buffer.page_size () in
+  let fd = Unix.openfile "testfile.aio" [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o664 in
+  let ctx = Aio.context 2 in
+  let buf = Aio.Buffer.create page in
+  let results = ref [] in
+  let cont name = function
+      Aio.Errno err when err = Aio.ecanceled -> results := (name, "canceled") :: !results
+    | Aio.Errno err when err = Aio.etimedout -> results := (name, "timedout") :: !results
+    | Aio.Errno _ -> results := (name, "error") :: !results
+    | _ -> results := (name, "done") :: !results
+  in
+  let write name off = Aio.Write (fd, Int64.of_int off, buf, 0, page, cont name)
+  in
+    Aio.Buffer.fill buf 0 page 1;
+    (* One request in the kernel at most, the second waits in the
+       context, the third for a slot *)
+    Aio.set_depth ctx 1;
+    let a = Aio.start ctx (write "a" 0) in
+    let b = Aio.start ctx (write "b" page) in
+    let c = Aio.start ctx (write "c" (2 * page))
+    in
+      check "cancel queued" (Aio.cancel ctx b);
+      check "cancel overflow" (Aio.cancel ctx c);
+      check "cancel right away"
+	(!results = [("c", "canceled"); ("b", "canceled")]);
+      check "cancel twice" (not (Aio.cancel ctx b));
+      (* The kernel may still finish a, but its continuation only runs
+	 once *)
+      check "cancel flushed" (Aio.cancel ctx a);
+      Aio.run ctx;
+      check "cancel pending" (Aio.get_pending ctx = 0);
+      check "cancel once" (List.length !results = 3);
+      check "cancel after completion" (not (Aio.cancel ctx a));
+      (* Cancelled before the kernel saw them, so nothing behind a *)
+      check "cancel not written"
+	((Unix.LargeFile.fstat fd).Unix.LargeFile.st_size <= Int64.of_int page);
+      Unix.close fd;
+      Unix.unlink "testfile.aio";
+      (* A poll on an empty pipe only ends by its deadline *)
+      let (rd, wr) = Unix.pipe () in
+      let polled = ref None
+      in
+	ignore (Aio.start ~timeout:0.01 ctx
+		  (Aio.Poll (rd, [Aio.Pollin], fun res -> polled := Some res)));
+	while !polled = None do Aio.step ctx done;
+	check "cancel deadline" (!polled = Some (Aio.Errno Aio.etimedout));
+	(* Wake the poll in case the kernel could not drop it *)
+	ignore (Unix.write_substring wr "x" 0 1);
+	Aio.run ctx;
+	Unix.close rd;
+	Unix.close wr
+
+(* Write pages through a context with fewer slots than pages, one of
+ * them with a deadline so the wait is timed, then read them back
+ * driven by the eventfd like an event loop would *)
+let round_trip name ctx =
+  let page = Aio.Buffer.page_size () in
+  let fd = Unix.openfile "testfile.aio" [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o664 in
+  let n = 16 in
+  let ok = ref 0 in
+  let count = function Aio.Result _ -> incr ok | _ -> ()
+  in
+    for i = 0 to n - 1 do
+      let buf = Aio.Buffer.create page
+      in
+	Aio.Buffer.fill buf 0 page i;
+	if i = 0
+	then ignore (Aio.start ~timeout:10.0 ctx
+		       (Aio.Write (fd, 0L, buf, 0, page, count)))
+	else Aio.write ctx fd (Int64.of_int (i * page)) buf count
+    done;
+    Aio.run ctx;
+    check (name ^ " writes") (!ok = n);
+    let bufs = Array.init n (fun _ -> Aio.Buffer.create page)
+    in
+      ok := 0;
+      Array.iteri
+	(fun i buf -> Aio.read ctx fd (Int64.of_int (i * page)) buf count)
+	bufs;
+      while Aio.get_pending ctx > 0 do
+	ignore (Unix.select [Aio.fd ctx] [] [] 1.0);
+	Aio.process ctx
+      done;
+      check (name ^ " reads") (!ok = n);
+      Array.iteri
+	(fun i buf ->
+	   check (name ^ " data")
+	     (Aio.Buffer.get_uint8 buf 0 = i
+	      && Aio.Buffer.get_uint8 buf (page - 1) = i))
+	bufs;
+      Unix.close fd;
+      Unix.unlink "testfile.aio"
+
+(* Both backends, io_uring only where it was built in and the kernel
+ * lets us have a ring *)
+let test_backends () =
+  round_trip "libaio" (Aio.context 4);
+  if Aio.uring_available ()
+  then
+    match
+      (try Some (Aio.context ~backend:Aio.Io_uring 4) with Aio.Error _ -> None)
+    with
+      Some ctx -> round_trip "io_uring" ctx
+    | None -> ()
+
+(* Read a file that ends in the middle of a chunk, whole and as a
+ * bounded range whose end is not chunk aligned either *)
+let test_stream () =
+  let page = Aio.Buffer.page_size () in
+  let size = 3 * page + 100 in
+  let byte i = i mod 251 in
+  let fd = Unix.openfile "testfile.aio" [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o664 in
+  let data = Bytes.init size (fun i -> Char.chr (byte i)) in
+  let ctx = Aio.context 4 in
+  let read_all name ?offset ?length expect_off expect_len =
+    let r = Aio.Stream.reader ~depth:2 ~chunk_size:page ~align:512 ?offset ?length ctx fd in
+    let pos = ref expect_off in
+    let rec loop () =
+      match Aio.Stream.next r with
+	None -> ()
+      | Some (buf, n) ->
+	  for i = 0 to n - 1 do
+	    if Aio.Buffer.get_uint8 buf i <> byte (!pos + i)
+	    then check (name ^ " data") false
+	  done;
+	  pos := !pos + n;
+	  Aio.Stream.release r buf;
+	  loop ()
+    in
+      loop ();
+      check (name ^ " length") (!pos - expect_off = expect_len);
+      Aio.Stream.close r;
+      check (name ^ " pending") (Aio.get_pending ctx = 0)
+  in
+    check "stream write" (Unix.write fd data 0 size = size);
+    read_all "stream" 0 size;
+    read_all "stream range" ~offset:(Int64.of_int page)
+      ~length:(Int64.of_int (page + 50)) page (page + 50);
+    Unix.close fd;
+    Unix.unlink "testfile.aio"
+
+(* Two threads sharing one shard: the lock makes the second wait until
+ * the first lets go, and both can run the shard at the same time since
+ * a thread waiting in the kernel gives the shard up *)
+let test_sharded () =
+  let page = Aio.Buffer.page_size () in
+  let fd = Unix.openfile "testfile.aio" [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o664 in
+  let sh = Aio.Sharded.create 1 8 in
+  let log = ref [] in
+  let entered = ref false in
+  let first () =
+    Aio.Sharded.with_shard sh 0 (fun _ ->
+      (* Taken again by the same thread *)
+      Aio.Sharded.with_local sh (fun _ -> entered := true);
+      Thread.delay 0.05;
+      log := "first" :: !log)
+  in
+  let second () =
+    Aio.Sharded.with_shard sh 0 (fun _ -> log := "second" :: !log)
+  in
+  let t1 = Thread.create first () in
+  let () = while not !entered do Thread.yield () done in
+  let t2 = Thread.create second ()
+  in
+    Thread.join t1;
+    Thread.join t2;
+    check "sharded lock" (!log = ["second"; "first"]);
+    let n = 32 in
+    let ok = ref 0 in
+    let writer base () =
+      for i = 0 to n - 1 do
+	let buf = Aio.Buffer.create page
+	in
+	  Aio.Sharded.write sh fd (Int64.of_int ((base + i) * page)) buf
+	    (function Aio.Result _ -> incr ok | _ -> ());
+	  if i mod 8 = 7 then Aio.Sharded.step sh
+      done;
+      Aio.Sharded.run sh
+    in
+    let t1 = Thread.create (writer 0) () in
+    let t2 = Thread.create (writer n) ()
+    in
+      Thread.join t1;
+      Thread.join t2;
+      check "sharded writes" (!ok = 2 * n);
+      check "sharded pending" (Aio.Sharded.pending sh = 0);
+      Unix.close fd;
+      Unix.unlink "testfile.aio"
+
+let () = test_checksums ()
+let () = test_overflow ()
+let () = test_wal ()
+let () = test_cancel ()
+let () = test_backends ()
+let () = test_stream ()
+let () = test_sharded ()
+
 let read_done result =
   let buffer = Aio.result result in
   let i64 = Aio.Buffer.get_net_int64 buffer 0 in
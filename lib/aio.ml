@@ -20,10 +20,14 @@ module Buffer = struct
   include Aio_buffer
 end
 
-type result =
-    Result of Buffer.t
+type 'a completion =
+    Result of 'a
   | Errno of int
-  | Partial of Buffer.t * int
+  | Partial of 'a * int
+
+type result = Buffer.t completion
+
+type vresult = Buffer.t array completion
 
 let call_result cont buffer =
   cont (Result buffer)
@@ -38,8 +42,26 @@ let _ = Callback.register "caml_aio_call_result" call_result
 let _ = Callback.register "caml_aio_call_error" call_error
 let _ = Callback.register "caml_aio_call_partial" call_partial
 
+type poll_event = Pollin | Pollpri | Pollout | Pollerr | Pollhup | Pollrdhup
+
+let poll_events = [| Pollin; Pollpri; Pollout; Pollerr; Pollhup; Pollrdhup |]
+
+(* mask has bit i set for poll_events.(i) *)
+let call_poll cont mask =
+  let rec loop i acc =
+    if i < 0
+    then acc
+    else loop (i - 1) (if mask land (1 lsl i) <> 0 then poll_events.(i) :: acc else acc)
+  in
+    cont (Result (loop (Array.length poll_events - 1) []))
+
+let _ = Callback.register "caml_aio_call_poll" call_poll
+
 exception Error of int
 exception Incomplete of Buffer.t * int
+exception Incomplete_vector of Buffer.t array * int
+
+let _ = Callback.register_exception "caml_aio_exn_error" (Error 0)
 
 let result = function
     (* FIXME: convert unix errno to exception from Unix module *)
@@ -47,25 +69,884 @@ let result = function
   | Partial (buf, len) -> raise (Incomplete (buf, len))
   | Result buf -> buf
 
+let vresult = function
+    Errno x -> raise (Error x)
+  | Partial (bufs, len) -> raise (Incomplete_vector (bufs, len))
+  | Result bufs -> bufs
 
 type context
 
-external context: int -> context = "caml_aio_context"
+type command =
+    Read of Unix.file_descr * int64 * Buffer.t * int * int * (result -> unit)
+  | Write of Unix.file_descr * int64 * Buffer.t * int * int * (result -> unit)
+  | Readv of Unix.file_descr * int64 * Buffer.t array * (vresult -> unit)
+  | Writev of Unix.file_descr * int64 * Buffer.t array * (vresult -> unit)
+  | Fsync of Unix.file_descr * (unit completion -> unit)
+  | Fdsync of Unix.file_descr * (unit completion -> unit)
+  | Poll of Unix.file_descr * poll_event list * (poll_event list completion -> unit)
 
-external read : context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit = "caml_aio_read"
+type backend = Libaio | Io_uring
+
+external make_context: int -> context = "caml_aio_context"
+external make_uring_context: int -> bool -> context = "caml_aio_uring_context"
+external uring_available : unit -> bool = "caml_aio_uring_available"
+external get_backend : context -> int = "caml_aio_get_backend"
+external get_depth : context -> int = "caml_aio_get_depth"
+external set_depth : context -> int -> unit = "caml_aio_set_depth"
+
+let backend ctx =
+  match get_backend ctx with
+    0 -> Libaio
+  | _ -> Io_uring
+
+let context ?depth ?(backend = Libaio) ?(sqpoll = false) max_ios =
+  let ctx =
+    match backend with
+      Libaio -> make_context max_ios
+    | Io_uring -> make_uring_context max_ios sqpoll
+  in
+    (match depth with
+       None -> ()
+     | Some depth -> set_depth ctx depth);
+    ctx
+
+type rw_flag = Hipri | Dsync | Sync | Nowait
+
+external read_flags : context -> rw_flag list -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit =
+  "caml_aio_read_flags_bytecode" "caml_aio_read_flags"
+external write_flags : context -> rw_flag list -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit =
+  "caml_aio_write_flags_bytecode" "caml_aio_write_flags"
+
+external read_all : context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit = "caml_aio_read"
 external read_multiple : context ->
                          (Unix.file_descr * int64 * Buffer.t * (result -> unit)) array ->
                          unit =
   "caml_aio_read_multiple"
 
-external write : context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit = "caml_aio_write"
+external read_range : context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit =
+  "caml_aio_read_sub_bytecode" "caml_aio_read_sub"
+external read_multiple_sub : context ->
+                             (Unix.file_descr * int64 * Buffer.t * int * int * (result -> unit)) array ->
+                             unit =
+  "caml_aio_read_multiple_sub"
+
+external write_all : context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit = "caml_aio_write"
+external write_range : context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit =
+  "caml_aio_write_sub_bytecode" "caml_aio_write_sub"
+
+let read ?(flags = []) ctx fd off buf fn =
+  match flags with
+    [] -> read_all ctx fd off buf fn
+  | _ -> read_flags ctx flags fd off buf 0 (Buffer.length buf) fn
+
+let read_sub ?(flags = []) ctx fd off buf buf_off len fn =
+  match flags with
+    [] -> read_range ctx fd off buf buf_off len fn
+  | _ -> read_flags ctx flags fd off buf buf_off len fn
+
+let write ?(flags = []) ctx fd off buf fn =
+  match flags with
+    [] -> write_all ctx fd off buf fn
+  | _ -> write_flags ctx flags fd off buf 0 (Buffer.length buf) fn
+
+let write_sub ?(flags = []) ctx fd off buf buf_off len fn =
+  match flags with
+    [] -> write_range ctx fd off buf buf_off len fn
+  | _ -> write_flags ctx flags fd off buf buf_off len fn
+
+external readv : context -> Unix.file_descr -> int64 -> Buffer.t array -> (vresult -> unit) -> unit = "caml_aio_readv"
+external writev : context -> Unix.file_descr -> int64 -> Buffer.t array -> (vresult -> unit) -> unit = "caml_aio_writev"
+
+external submit : context -> command array -> unit = "caml_aio_submit"
+
+(* The slot is filled in by C once the request has one *)
+type request = { id : int; mutable slot : int }
+
+external start_cmd : context -> command -> int -> request = "caml_aio_start"
+
+let start ?timeout ctx cmd =
+  let ns =
+    match timeout with
+      None -> 0
+    | Some t -> max 1 (int_of_float (t *. 1e9))
+  in
+    start_cmd ctx cmd ns
+
+external cancel : context -> request -> bool = "caml_aio_cancel"
+external ecanceled : unit -> int = "caml_aio_ecanceled" "noalloc"
+external etimedout : unit -> int = "caml_aio_etimedout" "noalloc"
+
+let ecanceled = ecanceled ()
+let etimedout = etimedout ()
+
+external fsync : context -> Unix.file_descr -> (unit completion -> unit) -> unit = "caml_aio_fsync"
+external fdatasync : context -> Unix.file_descr -> (unit completion -> unit) -> unit = "caml_aio_fdatasync"
+
+(* Tagged requests store the cookie where the continuation would go *)
+external read_tagged : context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> int -> unit =
+  "caml_aio_read_sub_bytecode" "caml_aio_read_sub"
+external write_tagged : context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> int -> unit =
+  "caml_aio_write_sub_bytecode" "caml_aio_write_sub"
+external reap_array : context -> int array -> bool -> int = "caml_aio_reap_array"
+external get_done : context -> int = "caml_aio_get_done"
+
+let reap ?(wait = false) ctx arr = reap_array ctx arr wait
 
-external poll : context -> Unix.file_descr -> int -> (Unix.file_descr -> unit) -> unit = "caml_aio_poll"
+external poll : context -> Unix.file_descr -> poll_event list -> (poll_event list completion -> unit) -> unit = "caml_aio_poll"
+
+module Timer = struct
+  type t = Unix.file_descr
+
+  external create : unit -> t = "caml_aio_timerfd_create"
+  external set_timer : t -> float -> float -> unit = "caml_aio_timerfd_set"
+  external disarm : t -> unit = "caml_aio_timerfd_disarm"
+  external expirations : t -> int = "caml_aio_timerfd_read"
+
+  let set ?(interval = 0.0) t delay = set_timer t delay interval
+
+  let close t = Unix.close t
+
+  let rec wait ctx t fn =
+    poll ctx t [Pollin]
+      (function
+	   Errno err -> fn (Errno err)
+	 | _ ->
+	     (* The timer may have been set again since it became ready *)
+	     let n = expirations t
+	     in
+	       if n = 0 then wait ctx t fn else fn (Result n))
+
+  let after ctx delay fn =
+    let t = create ()
+    in
+      set t delay;
+      wait ctx t
+	(fun res ->
+	   close t;
+	   match res with
+	     Errno err -> fn (Errno err)
+	   | _ -> fn (Result ()))
+end
 external run : context -> unit = "caml_aio_run"
 external process : context -> unit = "caml_aio_process"
+external process_nowait : context -> unit = "caml_aio_process_nowait"
+external step : context -> unit = "caml_aio_step"
+
+module Cookies = struct
+  type 'a t = {
+    ctx : context;
+    nobody : 'a;			(* filler for unused cookies *)
+    mutable waiters : 'a array;		(* indexed by cookie *)
+    mutable free : int array;		(* stack of free cookies *)
+    mutable nr_free : int;
+    reaped : int array;			(* cookie, res, res2 triples *)
+  }
+
+  let create ?(batch = 64) ctx nobody =
+    let n = 16
+    in
+      {
+	ctx = ctx;
+	nobody = nobody;
+	waiters = Array.make n nobody;
+	free = Array.init n (fun i -> n - 1 - i);
+	nr_free = n;
+	reaped = Array.make (3 * max 1 batch) 0;
+      }
+
+  let context t = t.ctx
+
+  let grow t =
+    let n = Array.length t.waiters in
+    let waiters = Array.make (2 * n) t.nobody
+    in
+      Array.blit t.waiters 0 waiters 0 n;
+      t.waiters <- waiters;
+      t.free <- Array.init (2 * n) (fun i -> 2 * n - 1 - i);
+      t.nr_free <- n
+
+  let add t waiter =
+    if t.nr_free = 0 then grow t;
+    t.nr_free <- t.nr_free - 1;
+    let cookie = t.free.(t.nr_free)
+    in
+      t.waiters.(cookie) <- waiter;
+      cookie
+
+  let remove t cookie =
+    let waiter = t.waiters.(cookie)
+    in
+      t.waiters.(cookie) <- t.nobody;
+      t.free.(t.nr_free) <- cookie;
+      t.nr_free <- t.nr_free + 1;
+      waiter
+
+  (* A request that could not be submitted gives its cookie back *)
+  let submit t waiter f =
+    let cookie = add t waiter
+    in
+      try
+	f cookie
+      with exn ->
+	ignore (remove t cookie);
+	raise exn
+
+  let read t fd off buf buf_off len waiter =
+    submit t waiter (read_tagged t.ctx fd off buf buf_off len)
+
+  let write t fd off buf buf_off len waiter =
+    submit t waiter (write_tagged t.ctx fd off buf buf_off len)
+
+  let drain t f =
+    process t.ctx;
+    let rec loop () =
+      let n = reap t.ctx t.reaped
+      in
+	for i = 0 to n - 1 do
+	  let waiter = remove t t.reaped.(3 * i) in
+	  let res = t.reaped.(3 * i + 1) in
+	  let res2 = t.reaped.(3 * i + 2)
+	  in
+	    if res < 0
+	    then f waiter (Errno (- res))
+	    else if res2 <> 0
+	    then f waiter (Errno res2)
+	    else f waiter (Result res)
+	done;
+	if 3 * n = Array.length t.reaped then loop ()
+    in
+      loop ()
+end
 
 external fd : context -> Unix.file_descr = "caml_aio_fd"
 external get_pending : context -> int = "caml_aio_get_pending"
 
+external register_buffers : context -> Buffer.t array -> unit = "caml_aio_register_buffers"
+external register_files : context -> Unix.file_descr array -> unit = "caml_aio_register_files"
+external get_queued : context -> int = "caml_aio_get_queued"
+external get_max_queued : context -> int = "caml_aio_get_max_queued"
+external get_overflowed : context -> int = "caml_aio_get_overflowed"
+
+type stats = {
+  submitted : int;
+  completed : int;
+  partial : int;
+  errors : int;
+  eagain : int;
+  bytes_read : int;
+  bytes_written : int;
+  max_inflight : int;
+  read_latency : int array;
+  write_latency : int array;
+  sync_latency : int array;
+  poll_latency : int array;
+}
+
+external stats : context -> stats = "caml_aio_stats"
+external reset_stats : context -> unit = "caml_aio_reset_stats"
+
+let latency_percentile hist p =
+  let total = Array.fold_left (+) 0 hist in
+  let limit = float_of_int total *. p in
+  let rec loop i seen =
+    if i >= Array.length hist - 1 then i
+    else
+      let seen = seen + hist.(i)
+      in
+        if seen > 0 && float_of_int seen >= limit then i
+        else loop (i + 1) seen
+  in
+    if total = 0 then 0 else 1 lsl (loop 0 0)
+
+module File = struct
+  type t = {
+    fd : Unix.file_descr;
+    mem_align : int;
+    offset_align : int;
+  }
+
+  external set_direct : Unix.file_descr -> unit = "caml_aio_set_direct"
+  external dio_align : Unix.file_descr -> int * int = "caml_aio_dio_align"
+  external dio_aligned : t -> int64 -> Buffer.t -> int -> int -> bool = "caml_aio_dio_aligned" "noalloc"
+  external dio_check : t -> int64 -> Buffer.t -> int -> int -> unit = "caml_aio_dio_check"
+
+  let of_fd fd =
+    set_direct fd;
+    let (mem_align, offset_align) = dio_align fd
+    in
+      { fd = fd; mem_align = mem_align; offset_align = offset_align }
+
+  let openfile ?(flags = [Unix.O_RDWR]) ?(perm = 0o644) path =
+    let fd = Unix.openfile path (Unix.O_CLOEXEC :: flags) perm
+    in
+      try
+	of_fd fd
+      with e ->
+	Unix.close fd;
+	raise e
+
+  let fd file = file.fd
+  let mem_align file = file.mem_align
+  let offset_align file = file.offset_align
+  let close file = Unix.close file.fd
+
+  (* Read the aligned range covering the request into a bounce buffer
+     and copy the requested part over on completion. *)
+  let bounce_read ?flags ctx file off buf buf_off len fn =
+    let align = Int64.of_int file.offset_align in
+    let start = Int64.mul (Int64.div off align) align in
+    let skip = Int64.to_int (Int64.sub off start) in
+    let total = (skip + len + file.offset_align - 1) / file.offset_align * file.offset_align in
+    let page = Buffer.page_size () in
+    let tmp = Buffer.create ((total + page - 1) / page * page) in
+    let copy n =
+      let n = max 0 (min len (n - skip))
+      in
+	Bigarray.Array1.blit
+	  (Bigarray.Array1.sub tmp skip n) (Bigarray.Array1.sub buf buf_off n);
+	n
+    in
+      read_sub ?flags ctx file.fd start tmp 0 total
+	(function
+	     Result _ -> ignore (copy total); fn (Result buf)
+	   | Partial (_, n) ->
+	       let n = copy n
+	       in
+		 if n = len then fn (Result buf) else fn (Partial (buf, n))
+	   | Errno err -> fn (Errno err))
+
+  let read ?flags ?(bounce = false) ctx file off buf buf_off len fn =
+    if bounce && not (dio_aligned file off buf buf_off len)
+    then begin
+      if buf_off < 0 || len < 0 || buf_off > Buffer.length buf - len
+      then raise (Invalid_argument "Aio: Index out of bounds.");
+      bounce_read ?flags ctx file off buf buf_off len fn
+    end else begin
+      dio_check file off buf buf_off len;
+      read_sub ?flags ctx file.fd off buf buf_off len fn
+    end
+
+  let write ?flags ctx file off buf buf_off len fn =
+    dio_check file off buf buf_off len;
+    write_sub ?flags ctx file.fd off buf buf_off len fn
+end
+
+module Stream = struct
+  type chunk_state =
+      Reading
+    | Done of int		(* bytes read, less than asked at the end *)
+    | Failed of int
+
+  type chunk = {
+    buf : Buffer.t;
+    mutable state : chunk_state;
+  }
+
+  type reader = {
+    ctx : context;
+    fd : Unix.file_descr;
+    chunk_size : int;
+    align : int;		(* reads are rounded up to multiples of it *)
+    stop : int64 option;	(* offset to stop reading at *)
+    mutable next_off : int64;	(* offset of the next chunk to read *)
+    mutable eof : bool;		(* no more chunks to read *)
+    mutable free : Buffer.t list;
+    mutable inflight : int;
+    chunks : chunk Queue.t;	(* chunks in file order *)
+  }
+
+  (* Start reads into all free buffers *)
+  let fill r =
+    let rec loop () =
+      match r.free with
+	buf :: rest when not r.eof ->
+	  let len =
+	    match r.stop with
+	      None -> r.chunk_size
+	    | Some stop ->
+		let left = Int64.sub stop r.next_off
+		in
+		  if left < Int64.of_int r.chunk_size
+		  then Int64.to_int left
+		  else r.chunk_size
+	  in
+	    if len <= 0
+	    then r.eof <- true
+	    else begin
+	      let chunk = { buf = buf; state = Reading } in
+	      let off = r.next_off in
+	      (* The tail of a bounded stream is read whole blocks for
+		 O_DIRECT, the bytes past the end are not reported *)
+	      let rlen = (len + r.align - 1) / r.align * r.align
+	      in
+		r.free <- rest;
+		r.next_off <- Int64.add off (Int64.of_int len);
+		r.inflight <- r.inflight + 1;
+		Queue.push chunk r.chunks;
+		read_sub r.ctx r.fd off buf 0 rlen
+		  (fun res ->
+		     r.inflight <- r.inflight - 1;
+		     match res with
+		       Result _ -> chunk.state <- Done len
+		     | Partial (_, n) ->
+			 (* A short read means the end of the file *)
+			 chunk.state <- Done (min n len);
+			 r.eof <- true
+		     | Errno err ->
+			 chunk.state <- Failed err;
+			 r.eof <- true);
+		loop ()
+	    end
+      | _ -> ()
+    in
+      loop ()
+
+  let reader ?(depth = 4) ?(chunk_size = 1024 * 1024) ?(align = 1) ?(offset = 0L) ?length ctx fd =
+    if depth <= 0
+    then raise (Invalid_argument "Aio.Stream.reader: depth must be positive.");
+    if align <= 0 || align land (align - 1) <> 0 || chunk_size mod align <> 0
+    then raise (Invalid_argument "Aio.Stream.reader: align must be a power of 2 dividing chunk_size.");
+    let r = {
+      ctx = ctx;
+      fd = fd;
+      chunk_size = chunk_size;
+      align = align;
+      stop = (match length with None -> None | Some l -> Some (Int64.add offset l));
+      next_off = offset;
+      eof = false;
+      free = Array.to_list (Array.init depth (fun _ -> Buffer.create chunk_size));
+      inflight = 0;
+      chunks = Queue.create ();
+    }
+    in
+      fill r;
+      r
+
+  let release r buf =
+    r.free <- buf :: r.free;
+    fill r
+
+  let rec next r =
+    if Queue.is_empty r.chunks
+    then None
+    else begin
+      let chunk = Queue.peek r.chunks
+      in
+	match chunk.state with
+	  Reading -> step r.ctx; next r
+	| Failed err ->
+	    (* Stop for good, the chunks behind the failed one would leave
+	       a hole in the data *)
+	    r.eof <- true;
+	    while r.inflight > 0 do
+	      step r.ctx
+	    done;
+	    Queue.iter (fun chunk -> r.free <- chunk.buf :: r.free) r.chunks;
+	    Queue.clear r.chunks;
+	    raise (Error err)
+	| Done 0 ->
+	    (* Read past the end, the chunks after it are empty too *)
+	    ignore (Queue.pop r.chunks);
+	    release r chunk.buf;
+	    next r
+	| Done n ->
+	    ignore (Queue.pop r.chunks);
+	    Some (chunk.buf, n)
+    end
+
+  let close r =
+    r.eof <- true;
+    while r.inflight > 0 do
+      step r.ctx
+    done;
+    Queue.clear r.chunks;
+    r.free <- []
+
+  type piece = {
+    piece_off : int64;
+    data : Buffer.t;		(* sub of the staging buffer to write *)
+    owner : Buffer.t option;	(* staging buffer to recycle once written *)
+  }
+
+  type writer = {
+    ctx : context;
+    fd : Unix.file_descr;
+    chunk_size : int;
+    depth : int;		(* writes in flight at most *)
+    max_buffers : int;
+    mutable allocated : int;
+    mutable spare : Buffer.t list;
+    mutable cur : Buffer.t;	(* staging buffer being appended to *)
+    mutable pos : int64;	(* file offset of cur.{0} *)
+    mutable cur_start : int;	(* first byte of cur not written yet *)
+    mutable cur_fill : int;
+    dirty : piece Queue.t;	(* pieces waiting for a write slot *)
+    mutable writing : int;
+    mutable failure : exn option;
+  }
+
+  (* Limit of buffers in one pwritev *)
+  let max_iov = 1024
+
+  let writer ?(depth = 4) ?(chunk_size = 1024 * 1024) ?(offset = 0L) ctx fd =
+    if depth <= 0
+    then raise (Invalid_argument "Aio.Stream.writer: depth must be positive.");
+    {
+      ctx = ctx;
+      fd = fd;
+      chunk_size = chunk_size;
+      depth = depth;
+      max_buffers = 2 * depth + 1;
+      allocated = 1;
+      spare = [];
+      cur = Buffer.create chunk_size;
+      pos = offset;
+      cur_start = 0;
+      cur_fill = 0;
+      dirty = Queue.create ();
+      writing = 0;
+      failure = None;
+    }
+
+  let check w =
+    match w.failure with
+      None -> ()
+    | Some exn -> raise exn
+
+  let fail w exn =
+    if w.failure = None then w.failure <- Some exn
+
+  (* Write out dirty pieces while there is room, merging adjacent ones
+   * into a single pwritev *)
+  let rec kick w =
+    if w.writing < w.depth && not (Queue.is_empty w.dirty)
+    then begin
+      let first = Queue.pop w.dirty in
+      let rec take acc next n =
+	if n = max_iov || Queue.is_empty w.dirty
+	  || (Queue.peek w.dirty).piece_off <> next
+	then List.rev acc
+	else begin
+	  let p = Queue.pop w.dirty
+	  in
+	    take (p :: acc) (Int64.add next (Int64.of_int (Buffer.length p.data))) (n + 1)
+	end
+      in
+      let pieces =
+	Array.of_list
+	  (take [first]
+	     (Int64.add first.piece_off (Int64.of_int (Buffer.length first.data))) 1)
+      in
+	w.writing <- w.writing + 1;
+	writev w.ctx w.fd first.piece_off (Array.map (fun p -> p.data) pieces)
+	  (fun res ->
+	     w.writing <- w.writing - 1;
+	     (match res with
+		Result _ -> ()
+	      | Partial (bufs, n) -> fail w (Incomplete_vector (bufs, n))
+	      | Errno err -> fail w (Error err));
+	     Array.iter
+	       (fun p ->
+		  match p.owner with
+		    None -> ()
+		  | Some buf -> w.spare <- buf :: w.spare)
+	       pieces;
+	     kick w);
+	kick w
+    end
+
+  let rec get_buffer w =
+    match w.spare with
+      buf :: rest -> w.spare <- rest; buf
+    | [] when w.allocated < w.max_buffers ->
+	w.allocated <- w.allocated + 1;
+	Buffer.create w.chunk_size
+    | [] -> step w.ctx; check w; get_buffer w
+
+  (* Queue the unwritten rest of the current buffer *)
+  let push_cur w owner =
+    Queue.push
+      { piece_off = Int64.add w.pos (Int64.of_int w.cur_start);
+	data = Buffer.sub w.cur w.cur_start (w.cur_fill - w.cur_start);
+	owner = owner; }
+      w.dirty;
+    w.cur_start <- w.cur_fill
+
+  let append_gen blit w src off len =
+    check w;
+    let rec loop off len =
+      if len > 0
+      then begin
+	if w.cur_fill = w.chunk_size
+	then begin
+	  (* Earlier writes from this buffer finished in flush *)
+	  if w.cur_start < w.cur_fill
+	  then push_cur w (Some w.cur)
+	  else w.spare <- w.cur :: w.spare;
+	  kick w;
+	  w.pos <- Int64.add w.pos (Int64.of_int w.chunk_size);
+	  w.cur <- get_buffer w;
+	  w.cur_start <- 0;
+	  w.cur_fill <- 0
+	end;
+	let n = min len (w.chunk_size - w.cur_fill)
+	in
+	  blit src off w.cur w.cur_fill n;
+	  w.cur_fill <- w.cur_fill + n;
+	  loop (off + n) (len - n)
+      end
+    in
+      loop off len
+
+  let append w buf off len = append_gen Buffer.blit w buf off len
+  let append_bytes w bytes off len = append_gen Buffer.blit_from_bytes w bytes off len
+  let append_string w str off len = append_gen Buffer.blit_from_string w str off len
+
+  let offset w = Int64.add w.pos (Int64.of_int w.cur_fill)
+
+  let flush w =
+    check w;
+    if w.cur_start < w.cur_fill
+    then begin
+      push_cur w None;
+      kick w
+    end;
+    while w.writing > 0 do
+      step w.ctx
+    done;
+    check w
+
+  let sync w =
+    flush w;
+    let res = ref None
+    in
+      fdatasync w.ctx w.fd (fun x -> res := Some x);
+      while !res = None do
+	step w.ctx
+      done;
+      match !res with
+	Some (Errno err) -> fail w (Error err); raise (Error err)
+      | _ -> ()
+end
+
+module Wal = struct
+  type t = {
+    ctx : context;
+    fd : Unix.file_descr;
+    align : int;
+    capacity : int;
+    mutable buf : Buffer.t;	(* batch being collected *)
+    mutable spare : Buffer.t;	(* batch being written *)
+    mutable base : int64;	(* file offset of buf.{0}, aligned *)
+    mutable fill : int;		(* bytes used in buf *)
+    mutable waiters : (unit completion -> unit) list; (* reversed *)
+    mutable busy : bool;	(* a batch is being written or synced *)
+    mutable failure : exn option;
+  }
+
+  let create ?(align = 1) ?(capacity = 1024 * 1024) ?(offset = 0L) ctx fd =
+    if align <= 0 || align land (align - 1) <> 0
+    then raise (Invalid_argument "Aio.Wal.create: align must be a power of 2.");
+    let page = Buffer.page_size () in
+    let capacity = (capacity + page - 1) / page * page in
+    let capacity = (capacity + align - 1) / align * align in
+    (* Start on an aligned offset, the partial block in front is read
+     * back so rewriting it keeps the data *)
+    let keep = Int64.to_int (Int64.rem offset (Int64.of_int align)) in
+    let base = Int64.sub offset (Int64.of_int keep) in
+    let buf = Buffer.create capacity
+    in
+      if keep > 0
+      then begin
+	let res = ref None
+	in
+	  read_sub ctx fd base buf 0 align (fun x -> res := Some x);
+	  while !res = None do
+	    step ctx
+	  done;
+	  match !res with
+	    Some (Errno err) -> raise (Error err)
+	  | Some (Partial (_, n)) when n < keep -> raise (Incomplete (buf, n))
+	  | _ -> ()
+      end;
+      {
+	ctx = ctx;
+	fd = fd;
+	align = align;
+	capacity = capacity;
+	buf = buf;
+	spare = Buffer.create capacity;
+	base = base;
+	fill = keep;
+	waiters = [];
+	busy = false;
+	failure = None;
+      }
+
+  let check t =
+    match t.failure with
+      None -> ()
+    | Some exn -> raise exn
+
+  (* Write out the collected batch, fdatasync it and tell all its
+   * committers. Commits arriving meanwhile go into the next batch. *)
+  let rec start t =
+    let buf = t.buf and base = t.base and fill = t.fill in
+    let waiters = List.rev t.waiters in
+    let len = (fill + t.align - 1) / t.align * t.align in
+    (* The next batch rewrites the partial block at the end *)
+    let keep = fill mod t.align
+    in
+      if len > fill then Buffer.fill buf fill (len - fill) 0;
+      Buffer.blit buf (fill - keep) t.spare 0 keep;
+      t.buf <- t.spare;
+      t.spare <- buf;
+      t.base <- Int64.add base (Int64.of_int (fill - keep));
+      t.fill <- keep;
+      t.waiters <- [];
+      t.busy <- true;
+      write_sub t.ctx t.fd base buf 0 len
+	(function
+	     Result _ -> fdatasync t.ctx t.fd (finish t waiters)
+	   | Partial (_, n) ->
+	       t.failure <- Some (Incomplete (buf, n));
+	       finish t waiters (Partial ((), n))
+	   | Errno err ->
+	       t.failure <- Some (Error err);
+	       finish t waiters (Errno err))
+
+  and finish t waiters res =
+    (match res with
+       Errno err when t.failure = None -> t.failure <- Some (Error err)
+     | _ -> ());
+    (* Still busy so commits from the continuations batch up *)
+    List.iter (fun cont -> cont res) waiters;
+    t.busy <- false;
+    if t.waiters <> []
+    then begin
+      if t.failure = None
+      then start t
+      else begin
+	let waiters = List.rev t.waiters
+	in
+	  t.waiters <- [];
+	  List.iter (fun cont -> cont res) waiters
+      end
+    end
+
+  let commit_gen blit t src off len cont =
+    check t;
+    if len > t.capacity - t.align
+    then raise (Invalid_argument "Aio.Wal.commit: record too large.");
+    while t.fill + len > t.capacity do
+      step t.ctx;
+      check t
+    done;
+    blit src off t.buf t.fill len;
+    t.fill <- t.fill + len;
+    t.waiters <- cont :: t.waiters;
+    if not t.busy then start t
+
+  let commit t buf off len cont = commit_gen Buffer.blit t buf off len cont
+  let commit_bytes t bytes off len cont = commit_gen Buffer.blit_from_bytes t bytes off len cont
+  let commit_string t str off len cont = commit_gen Buffer.blit_from_string t str off len cont
+
+  let offset t = Int64.add t.base (Int64.of_int t.fill)
+
+  let wait t =
+    while t.busy do
+      step t.ctx
+    done;
+    check t
+end
+
+module Sharded = struct
+  external lock : context -> unit = "caml_aio_lock"
+  external try_lock : context -> bool = "caml_aio_try_lock" "noalloc"
+  external unlock : context -> unit = "caml_aio_unlock" "noalloc"
+  external pin_cpu : int -> unit = "caml_aio_pin_cpu"
+  external domain_id : unit -> int = "caml_aio_domain_id" "noalloc"
+
+  type t = {
+    shards : context array;
+    cpus : int array;		(* cpu of each shard, empty if not pinned *)
+    self : unit -> int;		(* picks the shard of the caller *)
+  }
+
+  let create ?depth ?backend ?(cpus = [||]) ?(self = domain_id) n max_ios =
+    if n <= 0
+    then raise (Invalid_argument "Aio.Sharded.create: need at least one shard.");
+    {
+      shards = Array.init n (fun _ -> context ?depth ?backend max_ios);
+      cpus = cpus;
+      self = self;
+    }
+
+  let shards t = Array.length t.shards
+
+  let context t i = t.shards.(i)
+
+  let local t = t.self () mod Array.length t.shards
+
+  let with_shard t i f =
+    let ctx = t.shards.(i)
+    in
+      (* Sleeps while another thread holds the shard. Waiting in the
+	 kernel lets go of it, so a blocking run only holds it while it
+	 submits and calls continuations. *)
+      lock ctx;
+      let res = try f ctx with exn -> unlock ctx; raise exn
+      in
+	unlock ctx;
+	res
+
+  let with_local t f = with_shard t (local t) f
+
+  let pin t =
+    let n = Array.length t.cpus
+    in
+      if n > 0 then pin_cpu t.cpus.(local t mod n)
+
+  let read ?flags t fd off buf fn =
+    with_local t (fun ctx -> read ?flags ctx fd off buf fn)
+
+  let read_sub ?flags t fd off buf buf_off len fn =
+    with_local t (fun ctx -> read_sub ?flags ctx fd off buf buf_off len fn)
+
+  let write ?flags t fd off buf fn =
+    with_local t (fun ctx -> write ?flags ctx fd off buf fn)
+
+  let write_sub ?flags t fd off buf buf_off len fn =
+    with_local t (fun ctx -> write_sub ?flags ctx fd off buf buf_off len fn)
+
+  let submit t cmds = with_local t (fun ctx -> submit ctx cmds)
+
+  let step t = with_local t step
+
+  let run t = with_local t run
+
+  let steal t =
+    let n = Array.length t.shards in
+    let me = local t
+    in
+      for k = 1 to n - 1 do
+	let ctx = t.shards.((me + k) mod n)
+	in
+	  (* Skip shards busy in another domain *)
+	  if try_lock ctx
+	  then begin
+	    (try process_nowait ctx with exn -> unlock ctx; raise exn);
+	    unlock ctx
+	  end
+      done
+
+  let process t =
+    with_local t process_nowait;
+    steal t
+
+  let pending t =
+    Array.fold_left (fun acc ctx -> acc + get_pending ctx) 0 t.shards
+end
+
 external sync_read : Unix.file_descr -> int64 -> Buffer.t -> unit = "caml_aio_sync_read"
 external sync_write : Unix.file_descr -> int64 -> Buffer.t -> unit = "caml_aio_sync_write"
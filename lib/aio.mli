@@ -61,9 +61,11 @@ module Buffer : sig
   external unsafe_get_uint16 : t -> int -> int = "caml_aio_buffer_get_uint16" "noalloc"
   external unsafe_get_int16 : t -> int -> int = "caml_aio_buffer_get_int16" "noalloc"
   external unsafe_get_int31 : t -> int -> int = "caml_aio_buffer_get_int31" "noalloc"
-  external unsafe_get_int32 : t -> int -> int32 = "caml_aio_buffer_get_int32"
-  external unsafe_get_int64 : t -> int -> int64 = "caml_aio_buffer_get_int64"
-    (** Unsafe access without checks. *)
+  external unsafe_get_int32 : t -> int -> int32 = "%caml_bigstring_get32u"
+  external unsafe_get_int64 : t -> int -> int64 = "%caml_bigstring_get64u"
+    (** Unsafe access without checks. The int32 and int64 accessors of
+        all byte orders compile to a load (and byte swap) in native code
+        and allocate nothing unless the value escapes. *)
 
   val set_int8 : t -> int -> int -> unit
   val set_uint8 : t -> int -> int -> unit
@@ -81,8 +83,8 @@ module Buffer : sig
   val unsafe_set_uint16 : t -> int -> int -> unit
   val unsafe_set_int16 : t -> int -> int -> unit
   external unsafe_set_int31 : t -> int -> int -> unit = "caml_aio_buffer_set_int31" "noalloc"
-  external unsafe_set_int32 : t -> int -> int32 -> unit = "caml_aio_buffer_set_int32" "noalloc"
-  external unsafe_set_int64 : t -> int -> int64 -> unit = "caml_aio_buffer_set_int64" "noalloc"
+  external unsafe_set_int32 : t -> int -> int32 -> unit = "%caml_bigstring_set32u"
+  external unsafe_set_int64 : t -> int -> int64 -> unit = "%caml_bigstring_set64u"
     (** Unsafe access without checks. *)
 
   external unsafe_get_substr : t -> int -> int -> string = "caml_aio_buf_unsafe_get_substr_stub"
@@ -99,6 +101,28 @@ module Buffer : sig
   val set_str : string -> t
     (** convert string to buffer *)
 
+  val blit_to_bytes : t -> int -> Bytes.t -> int -> int -> unit
+    (** [blit_to_bytes buf off bytes bytes_off len] copies [len] bytes
+        from the buffer into existing bytes *)
+  val blit_from_bytes : Bytes.t -> int -> t -> int -> int -> unit
+    (** [blit_from_bytes bytes bytes_off buf off len] copies [len] bytes
+        into the buffer *)
+  val blit_from_string : string -> int -> t -> int -> int -> unit
+    (** [blit_from_string str str_off buf off len] copies [len] bytes
+        into the buffer *)
+  val blit : t -> int -> t -> int -> int -> unit
+    (** [blit src src_off dst dst_off len] copies [len] bytes between
+        buffers, the ranges may overlap *)
+  val fill : t -> int -> int -> int -> unit
+    (** [fill buf off len x] sets [len] bytes to [x] *)
+  val compare : t -> int -> t -> int -> int -> int
+    (** [compare buf1 off1 buf2 off2 len] compares [len] bytes like
+        memcmp and returns -1, 0 or 1 *)
+  val sub : t -> int -> int -> t
+    (** [sub buf off len] is a view of [len] bytes of the buffer starting
+        at [off]. It shares memory with [buf] and keeps it alive. The
+        view is only page aligned if [off] is. *)
+
   (* Big endian byte order *)
   val get_be_int8 : t -> int -> int
   val get_be_uint8 : t -> int -> int
@@ -114,8 +138,8 @@ module Buffer : sig
   external unsafe_get_be_int16 : t -> int -> int = "caml_aio_buffer_get_be_int16" "noalloc"
   external unsafe_get_be_uint16 : t -> int -> int = "caml_aio_buffer_get_be_uint16" "noalloc"
   external unsafe_get_be_int31 : t -> int -> int = "caml_aio_buffer_get_be_int31" "noalloc"
-  external unsafe_get_be_int32 : t -> int -> int32 = "caml_aio_buffer_get_be_int32"
-  external unsafe_get_be_int64 : t -> int -> int64 = "caml_aio_buffer_get_be_int64"
+  val unsafe_get_be_int32 : t -> int -> int32
+  val unsafe_get_be_int64 : t -> int -> int64
     (** Unsafe access without checks. *)
 
   val set_be_int8 : t -> int -> int -> unit
@@ -132,8 +156,8 @@ module Buffer : sig
   external unsafe_set_be_int16 : t -> int -> int -> unit = "caml_aio_buffer_set_be_int16" "noalloc"
   external unsafe_set_be_uint16 : t -> int -> int -> unit = "caml_aio_buffer_set_be_uint16" "noalloc"
   external unsafe_set_be_int31 : t -> int -> int -> unit = "caml_aio_buffer_set_be_int31" "noalloc"
-  external unsafe_set_be_int32 : t -> int -> int32 -> unit = "caml_aio_buffer_set_be_int32" "noalloc"
-  external unsafe_set_be_int64 : t -> int -> int64 -> unit = "caml_aio_buffer_set_be_int64" "noalloc"
+  val unsafe_set_be_int32 : t -> int -> int32 -> unit
+  val unsafe_set_be_int64 : t -> int -> int64 -> unit
     (** Unsafe access without checks. *)
 
 
@@ -152,8 +176,8 @@ module Buffer : sig
   external unsafe_get_le_int16 : t -> int -> int = "caml_aio_buffer_get_le_int16" "noalloc"
   external unsafe_get_le_uint16 : t -> int -> int = "caml_aio_buffer_get_le_uint16" "noalloc"
   external unsafe_get_le_int31 : t -> int -> int = "caml_aio_buffer_get_le_int31" "noalloc"
-  external unsafe_get_le_int32 : t -> int -> int32 = "caml_aio_buffer_get_le_int32"
-  external unsafe_get_le_int64 : t -> int -> int64 = "caml_aio_buffer_get_le_int64"
+  val unsafe_get_le_int32 : t -> int -> int32
+  val unsafe_get_le_int64 : t -> int -> int64
     (** Unsafe access without checks. *)
 
   val set_le_int8 : t -> int -> int -> unit
@@ -170,8 +194,8 @@ module Buffer : sig
   external unsafe_set_le_int16 : t -> int -> int -> unit = "caml_aio_buffer_set_le_int16" "noalloc"
   external unsafe_set_le_uint16 : t -> int -> int -> unit = "caml_aio_buffer_set_le_uint16" "noalloc"
   external unsafe_set_le_int31 : t -> int -> int -> unit = "caml_aio_buffer_set_le_int31" "noalloc"
-  external unsafe_set_le_int32 : t -> int -> int32 -> unit = "caml_aio_buffer_set_le_int32" "noalloc"
-  external unsafe_set_le_int64 : t -> int -> int64 -> unit = "caml_aio_buffer_set_le_int64" "noalloc"
+  val unsafe_set_le_int32 : t -> int -> int32 -> unit
+  val unsafe_set_le_int64 : t -> int -> int64 -> unit
     (** Unsafe access without checks. *)
 
 (* Network byte order *)
@@ -210,31 +234,182 @@ module Buffer : sig
   val unsafe_set_net_int32 : t -> int -> int32 -> unit
   val unsafe_set_net_int64 : t -> int -> int64 -> unit
     (** Unsafe access without checks. *)
+
+  (* Bulk conversion between the buffer and arrays of integers *)
+  type int32s = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+  type int64s = (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+  val blit_be_int32_to_bigarray : t -> int -> int32s -> int -> int -> unit
+  val blit_be_int32_to_array : t -> int -> int array -> int -> int -> unit
+  val blit_be_int32_from_bigarray : t -> int -> int32s -> int -> int -> unit
+  val blit_be_int32_from_array : t -> int -> int array -> int -> int -> unit
+  val blit_be_int64_to_bigarray : t -> int -> int64s -> int -> int -> unit
+  val blit_be_int64_to_array : t -> int -> int array -> int -> int -> unit
+  val blit_be_int64_from_bigarray : t -> int -> int64s -> int -> int -> unit
+  val blit_be_int64_from_array : t -> int -> int array -> int -> int -> unit
+    (** [blit_be_int64_to_bigarray buf off dst dst_off n] decodes [n]
+        big endian values starting at byte [off] of the buffer into
+        [dst] starting at [dst_off]; the [from] variants encode the other
+        way. Runs of values are byte swapped with SIMD instructions where
+        the CPU has them. Offsets need no alignment. Decoding int64 into
+        an int array drops the topmost bit. *)
+
+  val blit_le_int32_to_bigarray : t -> int -> int32s -> int -> int -> unit
+  val blit_le_int32_to_array : t -> int -> int array -> int -> int -> unit
+  val blit_le_int32_from_bigarray : t -> int -> int32s -> int -> int -> unit
+  val blit_le_int32_from_array : t -> int -> int array -> int -> int -> unit
+  val blit_le_int64_to_bigarray : t -> int -> int64s -> int -> int -> unit
+  val blit_le_int64_to_array : t -> int -> int array -> int -> int -> unit
+  val blit_le_int64_from_bigarray : t -> int -> int64s -> int -> int -> unit
+  val blit_le_int64_from_array : t -> int -> int array -> int -> int -> unit
+    (** Same for little endian values. *)
+
+  external unsafe_crc32c : t -> int -> int -> int -> int = "caml_aio_buffer_crc32c" "noalloc"
+  val crc32c : ?crc:int -> t -> int -> int -> int
+    (** [crc32c buf off len] computes the CRC32C (Castagnoli) of [len]
+        bytes starting at [off]. Pass the result of the previous range
+        as [crc] to continue a checksum. Uses the SSE4.2 crc32
+        instruction where the CPU has it. *)
+
+  external unsafe_xxhash64 : t -> int -> int -> int64 -> int64 = "caml_aio_buffer_xxhash64"
+  val xxhash64 : ?seed:int64 -> t -> int -> int -> int64
+    (** [xxhash64 buf off len] computes the XXH64 hash of [len] bytes
+        starting at [off]. *)
+
+  (** Fixed size buffers carved out of one large block of memory.
+      Handing buffers out and taking them back allocates nothing.
+
+      The memory is freed once the pool and all its buffers, sub-arrays
+      of them included, are garbage collected. A buffer stays valid
+      after its pool became unreachable. *)
+  module Pool : sig
+    type buffer = t
+
+    type t
+      (** The type for a pool of buffers. *)
+
+    exception Exhausted
+      (** Exception when all buffers of a pool are in use. *)
+
+    val create : ?huge:bool -> ?populate:bool -> int -> int -> t
+      (** [create size count] allocates memory for [count] buffers of [size]
+	  bytes each. [size] must be a multiple of the page size. With
+	  [huge] the memory is aligned to 2 MiB and backed by transparent
+	  huge pages. With [populate] all pages are faulted in right
+	  away. *)
+
+    val alloc : t -> buffer
+      (** take a free buffer from the pool. Its content is whatever the
+	  last user left in it. Raises [Exhausted] if none is left. *)
+
+    val free : t -> buffer -> unit
+      (** return a buffer to the pool. Raises [Invalid_argument] if it
+	  was not handed out by [alloc] of this pool. *)
+
+    val buffer_size : t -> int
+      (** size of the buffers of the pool *)
+
+    val capacity : t -> int
+      (** number of buffers of the pool *)
+
+    val available : t -> int
+      (** number of free buffers of the pool *)
+  end
 end
 
 
-type result =
-    Result of Buffer.t
+type 'a completion =
+    Result of 'a
   | Errno of int
-  | Partial of Buffer.t * int
+  | Partial of 'a * int
+  (** The type for the outcome of a completed I/O request. [Partial]
+      carries the number of bytes actually transferred. *)
+
+type result = Buffer.t completion
   (** The type for a result of a completed I/O request *)
 
+type vresult = Buffer.t array completion
+  (** The type for a result of a completed vectored I/O request *)
+
 exception Error of int
-  (** An error has occured during a request. *)
+  (** An error has occured during a request or its submission. *)
 
 exception Incomplete of Buffer.t * int
   (** A request was only partialy completed. *)
 
+exception Incomplete_vector of Buffer.t array * int
+  (** A vectored request was only partially completed. *)
+
 val result : result -> Buffer.t
   (** Extract the Buffer.t from a result or throw the proper exception *)
 
-type context
-  (** The type for a libaio Context. *)
-
-val context : int -> context
-  (** Create a new context for n simultaneous requests. *)
+val vresult : vresult -> Buffer.t array
+  (** Extract the buffers from a vresult or throw the proper exception *)
 
-val read : context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit
+type context
+  (** The type for a libaio Context.
+
+      A context is protected by the OCaml runtime lock: every function
+      below changes it only while holding the lock, so requests can be
+      submitted from any thread of a domain. {!run}, {!step} and
+      {!reap} with [wait] release the lock while they wait for the
+      kernel and other threads keep running, including ones that submit
+      to the same context.
+
+      Completions are collected by one thread at a time, the reaper.
+      While a thread waits in the kernel, {!run}, {!step} and {!reap}
+      with [wait] called by another thread wait for it to finish and
+      count what it collected as progress. {!process}, {!process_nowait}
+      and {!reap} without [wait] return and leave the completions to it.
+      Continuations are called in the thread that collected the
+      completion.
+
+      With OCaml 5 every domain has its own runtime lock, which protects
+      nothing against other domains. A context must not be shared
+      between domains; use {!Sharded} for that. *)
+
+type backend =
+    Libaio	(** Linux kernel AIO through libaio *)
+  | Io_uring	(** io_uring through liburing *)
+  (** The kernel interface a context uses. *)
+
+val uring_available : unit -> bool
+  (** whether the library was built with io_uring support *)
+
+val context : ?depth:int -> ?backend:backend -> ?sqpoll:bool -> int -> context
+  (** Create a new context for n simultaneous requests. At most [depth]
+      (default n) of them are handed to the kernel at a time, the rest is
+      queued in the context and submitted in batches as earlier requests
+      complete. Requests beyond n are held back as well until slots free
+      up in {!run} or {!process}.
+
+      [backend] selects the kernel interface (default [Libaio]). All
+      functions behave the same for both. With [Io_uring] and [sqpoll]
+      a kernel thread polls the submission queue so submitting needs no
+      system call; older kernels only allow registered files then.
+      Raises [Error] with ENOSYS if io_uring support was not built in. *)
+
+val backend : context -> backend
+  (** return the kernel interface of the context *)
+
+val get_depth : context -> int
+  (** return the number of requests handed to the kernel at most *)
+
+val set_depth : context -> int -> unit
+  (** change the number of requests handed to the kernel at most. It is
+      capped at the size of the context. *)
+
+type rw_flag =
+    Hipri	(** poll for completion, for devices opened with O_DIRECT *)
+  | Dsync	(** write through like O_DSYNC for this request only *)
+  | Sync	(** write through like O_SYNC for this request only *)
+  | Nowait	(** fail with EAGAIN instead of blocking, e.g. on a page
+		    cache miss *)
+  (** Per request flags for reads and writes (RWF_* of preadv2). Kernels
+      that don't know a flag complete the request with EINVAL or
+      EOPNOTSUPP. *)
+
+val read : ?flags:rw_flag list -> context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit
   (** fill buffer from file at given offset and call continuation *)
 
 val read_multiple : context ->
@@ -242,17 +417,187 @@ val read_multiple : context ->
                     unit
  (** fill buffers from files at given offsets and call continuations *)
 
-val write : context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit
+val read_sub : ?flags:rw_flag list -> context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit
+  (** [read_sub ctx fd off buf buf_off len fn] fills [len] bytes of buffer
+      starting at [buf_off] from file at given offset and calls continuation.
+      The continuation gets the whole buffer. A [Partial] result counts the
+      bytes transferred into the range. *)
+
+val read_multiple_sub : context ->
+                        (Unix.file_descr * int64 * Buffer.t * int * int * (result -> unit)) array ->
+                        unit
+ (** fill ranges of buffers from files at given offsets and call continuations *)
+
+val write : ?flags:rw_flag list -> context -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit
   (** write buffer to file at given offset and call continuation *)
 
-val poll : context -> Unix.file_descr -> int -> (Unix.file_descr -> unit) -> unit
-  (** poll file descriptor and call continuation *)
+val write_sub : ?flags:rw_flag list -> context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit
+  (** [write_sub ctx fd off buf buf_off len fn] writes [len] bytes of buffer
+      starting at [buf_off] to file at given offset and calls continuation *)
+
+val readv : context -> Unix.file_descr -> int64 -> Buffer.t array -> (vresult -> unit) -> unit
+  (** fill buffers in order from file at given offset with a single
+      request and call continuation *)
+
+val writev : context -> Unix.file_descr -> int64 -> Buffer.t array -> (vresult -> unit) -> unit
+  (** write buffers in order to file at given offset with a single
+      request and call continuation *)
+
+type poll_event = Pollin | Pollpri | Pollout | Pollerr | Pollhup | Pollrdhup
+  (** The events of poll(2) *)
+
+type command =
+    Read of Unix.file_descr * int64 * Buffer.t * int * int * (result -> unit)
+      (** [Read (fd, off, buf, buf_off, len, fn)] like {!read_sub} *)
+  | Write of Unix.file_descr * int64 * Buffer.t * int * int * (result -> unit)
+      (** [Write (fd, off, buf, buf_off, len, fn)] like {!write_sub} *)
+  | Readv of Unix.file_descr * int64 * Buffer.t array * (vresult -> unit)
+      (** like {!readv} *)
+  | Writev of Unix.file_descr * int64 * Buffer.t array * (vresult -> unit)
+      (** like {!writev} *)
+  | Fsync of Unix.file_descr * (unit completion -> unit)
+      (** flush data and metadata of the file to disk *)
+  | Fdsync of Unix.file_descr * (unit completion -> unit)
+      (** flush data of the file to disk *)
+  | Poll of Unix.file_descr * poll_event list * (poll_event list completion -> unit)
+      (** like {!poll} *)
+  (** A request for {!submit} *)
+
+val submit : context -> command array -> unit
+  (** prepare all commands and hand them to the kernel with a single
+      io_submit (or more if the kernel accepts only part of them).
+      A request the kernel refuses completes with [Errno]. *)
+
+type request
+  (** Handle of a request that can be cancelled. *)
+
+val start : ?timeout:float -> context -> command -> request
+  (** prepare the command and hand it to the kernel like {!submit} and
+      return a handle for {!cancel}. If it is not done [timeout] seconds
+      from now it is cancelled with {!etimedout}. Deadlines are checked
+      while {!run}, {!step} or a process function runs, run and step
+      wake up for them. *)
+
+val cancel : context -> request -> bool
+  (** cancel a request and call its continuation with [Errno]
+      {!ecanceled} right away. A request still waiting in the context
+      never reaches the kernel. A request the kernel already has is asked
+      to be dropped, but it may still complete, e.g. a write may reach
+      the disk anyway. Its buffer stays in use until the
+      kernel let go of it, which {!run} still waits for. Returns false
+      if the request has completed already. *)
+
+val ecanceled : int
+  (** errno of cancelled requests *)
+
+val etimedout : int
+  (** errno of requests cancelled by their deadline *)
+
+val fsync : context -> Unix.file_descr -> (unit completion -> unit) -> unit
+  (** flush data and metadata of the file to disk and call continuation *)
+
+val fdatasync : context -> Unix.file_descr -> (unit completion -> unit) -> unit
+  (** flush data of the file to disk and call continuation *)
+
+val read_tagged : context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> int -> unit
+  (** [read_tagged ctx fd off buf buf_off len cookie] like {!read_sub}
+      but instead of calling a continuation the completion is recorded
+      under [cookie] for {!reap}. *)
+
+val write_tagged : context -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> int -> unit
+  (** [write_tagged ctx fd off buf buf_off len cookie] like {!write_sub}
+      but instead of calling a continuation the completion is recorded
+      under [cookie] for {!reap}. *)
+
+val reap : ?wait:bool -> context -> int array -> int
+  (** [reap ctx arr] collects finished requests like {!process_nowait}
+      and stores completed tagged requests as [cookie, res, res2]
+      triples in [arr]. Returns the number of triples. [res] is the
+      number of bytes transferred or the negated errno. Nothing is
+      allocated per completion. With [wait] (default false) it blocks
+      until something completes if no tagged request is done yet; it may
+      still return 0 when only requests with continuations finished.
+      {!run} and {!process} keep tagged completions for [reap] too. *)
+
+val get_done : context -> int
+  (** return the number of completed tagged requests waiting for {!reap} *)
+
+val poll : context -> Unix.file_descr -> poll_event list -> (poll_event list completion -> unit) -> unit
+  (** wait until the file descriptor is ready for one of the events and
+      call continuation with the events that are ready. Sockets and
+      pipes can be driven by the same context as disk I/O this way. One
+      poll reports readiness once, submit it again for more. Like other
+      requests it waits in the context while all slots are taken. *)
+
+module Timer : sig
+  type t
+    (** A timer backed by a timerfd (CLOCK_MONOTONIC) *)
+
+  val create : unit -> t
+    (** create a disarmed timer *)
+
+  val set : ?interval:float -> t -> float -> unit
+    (** [set t delay] arms the timer to expire in [delay] seconds and
+        then every [interval] seconds if given *)
+
+  val disarm : t -> unit
+    (** stop the timer *)
+
+  val wait : context -> t -> (int completion -> unit) -> unit
+    (** call continuation with the number of expirations once the timer
+        expired, through a poll on the context *)
+
+  val close : t -> unit
+    (** close the timerfd, wait for nothing on it anymore *)
+
+  val after : context -> float -> (unit completion -> unit) -> unit
+    (** [after ctx delay fn] calls [fn] once [delay] seconds passed with
+        a timer of its own *)
+end
 
 val run : context -> unit
-  (** run the context till there are no more pending requests *)
+  (** run the context till there are no more pending requests. Other
+      threads run while it waits for the kernel. *)
 
 val process : context -> unit
-  (** process finished events and return *)
+  (** process finished events and return. Never blocks. *)
+
+val process_nowait : context -> unit
+  (** process events that already finished and return without any
+      system call if possible. Unlike {!process} it does not clear the
+      eventfd, meant for loops that poll the context instead of waiting
+      on {!fd}. *)
+
+val step : context -> unit
+  (** wait until at least one request completes, call the continuations
+      of all finished requests and return. Raises [Error] with EAGAIN if
+      nothing is in flight and the kernel refuses more. *)
+
+module Cookies : sig
+  type 'a t
+    (** Waiters of tagged requests, e.g. promises, indexed by their
+        cookie. The building block of event loop integrations such as
+        aio_lwt and aio_async. *)
+
+  val create : ?batch:int -> context -> 'a -> 'a t
+    (** [create ctx nobody] creates an empty table for the context.
+        [nobody] fills unused entries. Completions are collected [batch]
+        (default 64) at a time. *)
+
+  val context : 'a t -> context
+    (** the context of the table *)
+
+  val read : 'a t -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> 'a -> unit
+  val write : 'a t -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> 'a -> unit
+    (** [read t fd off buf buf_off len waiter] like {!read_tagged} with
+        a cookie for [waiter]. If submitting raises the cookie is freed
+        again before the exception is passed on. *)
+
+  val drain : 'a t -> ('a -> int completion -> unit) -> unit
+    (** {!process} the context and hand every completed request to
+        [f waiter res], with [Result] of the bytes transferred or
+        [Errno]. Its cookie is free again by then. *)
+end
 
 val fd : context -> Unix.file_descr
   (** return eventfd associated with the context *)
@@ -260,6 +605,267 @@ val fd : context -> Unix.file_descr
 val get_pending : context -> int
   (** return the number of pending requests *)
 
+val register_buffers : context -> Buffer.t array -> unit
+  (** Register buffers with the kernel. Reads and writes that fall
+      completely within a registered buffer skip mapping the pages for
+      every request. Replaces earlier registered buffers. The context
+      must have no pending requests. Does nothing for [Libaio]. *)
+
+val register_files : context -> Unix.file_descr array -> unit
+  (** Register files with the kernel. Requests on them skip the file
+      table lookup. Replaces earlier registered files. The context must
+      have no pending requests. Does nothing for [Libaio]. *)
+
+val get_queued : context -> int
+  (** return the number of requests waiting in the context to be handed
+      to the kernel *)
+
+val get_max_queued : context -> int
+  (** return the highest number of requests that were waiting in the
+      context at any time *)
+
+val get_overflowed : context -> int
+  (** return the number of requests that had to wait for a free slot
+      because the context was full *)
+
+type stats = {
+  submitted : int;	(** requests prepared *)
+  completed : int;	(** requests completed, including failed ones *)
+  partial : int;	(** requests that transferred fewer bytes than asked *)
+  errors : int;		(** requests that completed with an error *)
+  eagain : int;		(** times the kernel refused requests for lack of resources *)
+  bytes_read : int;	(** bytes transferred by completed reads *)
+  bytes_written : int;	(** bytes transferred by completed writes *)
+  max_inflight : int;	(** highest number of requests in the kernel at once *)
+  read_latency : int array;
+  write_latency : int array;
+  sync_latency : int array;
+  poll_latency : int array;
+    (** Histograms of the time from submitting to reaping a request by
+        kind. Element [b] counts requests that took less than [2^b]
+        microseconds but not less than [2^(b-1)]; the last element also
+        counts everything slower. *)
+}
+  (** I/O statistics of a context *)
+
+val stats : context -> stats
+  (** return a snapshot of the statistics of the context. They are
+      always collected and cost one clock read per request plus one per
+      batch of completions. *)
+
+val reset_stats : context -> unit
+  (** zero the statistics of the context *)
+
+val latency_percentile : int array -> float -> int
+  (** [latency_percentile hist p] returns the upper bound in microseconds
+      of the bucket of [hist] holding the [p] (0.0 - 1.0) quantile, 0 if
+      the histogram is empty. *)
+
+module File : sig
+  type t
+    (** A file opened for direct I/O (O_DIRECT) together with its
+        alignment requirements. *)
+
+  val openfile : ?flags:Unix.open_flag list -> ?perm:int -> string -> t
+    (** [openfile path] opens the file with O_DIRECT (default flags
+        [[O_RDWR]], perm 0o644) and discovers its alignment. Raises
+        [Error] if the file can't do direct I/O. *)
+
+  val of_fd : Unix.file_descr -> t
+    (** turn on O_DIRECT for an open file and discover its alignment *)
+
+  val fd : t -> Unix.file_descr
+    (** the file descriptor of the file *)
+
+  val mem_align : t -> int
+    (** alignment buffer addresses need for direct I/O *)
+
+  val offset_align : t -> int
+    (** alignment file offsets and lengths need for direct I/O. Taken
+        from statx (STATX_DIOALIGN), BLKSSZGET for block devices or the
+        preferred block size of the file otherwise. *)
+
+  val close : t -> unit
+    (** close the file *)
+
+  val read : ?flags:rw_flag list -> ?bounce:bool -> context -> t -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit
+    (** [read ctx file off buf buf_off len fn] like {!read_sub} but raises
+        [Error] with EINVAL right away if the request is not aligned for
+        direct I/O. With [bounce] a misaligned request is instead read
+        through an aligned temporary buffer and copied over. *)
+
+  val write : ?flags:rw_flag list -> context -> t -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit
+    (** [write ctx file off buf buf_off len fn] like {!write_sub} but
+        raises [Error] with EINVAL right away if the request is not
+        aligned for direct I/O. *)
+end
+
+module Stream : sig
+  type reader
+    (** A sequential reader keeping several chunk reads in flight. *)
+
+  val reader : ?depth:int -> ?chunk_size:int -> ?align:int -> ?offset:int64 ->
+               ?length:int64 -> context -> Unix.file_descr -> reader
+    (** [reader ctx fd] reads the file from [offset] (default 0) for
+        [length] bytes or up to the end of the file. It allocates
+        [depth] (default 4) buffers of [chunk_size] (default 1 MiB, a
+        multiple of the page size) and keeps reads into all free ones in
+        flight ahead of the consumer. The last chunk of a [length]
+        bounded stream is read in multiples of [align] (default 1), use
+        {!File.offset_align} and an aligned [offset] for O_DIRECT; only
+        the bytes up to [length] are reported. *)
+
+  val next : reader -> (Buffer.t * int) option
+    (** return the next chunk in file order and the number of bytes read
+        into it, running the context until it is there. [None] after the
+        end of the file, the first short read counts as the end. Raises
+        [Error] if the read failed; the stream then stops, reads still
+        in flight are waited for and dropped and further calls return
+        [None]. The buffer belongs to the caller until it is passed to
+        {!release}. *)
+
+  val release : reader -> Buffer.t -> unit
+    (** hand a buffer from {!next} back so it can be read into again *)
+
+  val close : reader -> unit
+    (** stop reading ahead and wait for reads still in flight *)
+
+  type writer
+    (** An appending writer staging data in large buffers. *)
+
+  val writer : ?depth:int -> ?chunk_size:int -> ?offset:int64 ->
+               context -> Unix.file_descr -> writer
+    (** [writer ctx fd] appends to the file starting at [offset] (default
+        0). Data is copied into staging buffers of [chunk_size] (default
+        1 MiB, a multiple of the page size) and a buffer is written out
+        as soon as it is full. At most [depth] (default 4) writes are in
+        flight, buffers filled meanwhile are merged into one pwritev.
+        Appending blocks in the context once [2 * depth + 1] buffers are
+        in use. *)
+
+  val append : writer -> Buffer.t -> int -> int -> unit
+    (** [append w buf off len] appends [len] bytes of [buf] from [off].
+        Raises the error of an earlier failed write, [Error] or
+        [Incomplete_vector], and keeps doing so. *)
+
+  val append_bytes : writer -> Bytes.t -> int -> int -> unit
+    (** like {!append} *)
+
+  val append_string : writer -> string -> int -> int -> unit
+    (** like {!append} *)
+
+  val offset : writer -> int64
+    (** file offset the next append goes to *)
+
+  val flush : writer -> unit
+    (** write out all appended data and wait for it. For a file opened
+        with O_DIRECT the data flushed must end on an aligned offset. *)
+
+  val sync : writer -> unit
+    (** {!flush} and fdatasync the file *)
+end
+
+module Wal : sig
+  type t
+    (** A write-ahead log committing records in groups. *)
+
+  val create : ?align:int -> ?capacity:int -> ?offset:int64 ->
+               context -> Unix.file_descr -> t
+    (** [create ctx fd] appends records to the log starting at [offset]
+        (default 0). While one batch is written and fdatasynced the
+        records committed meanwhile collect in a buffer of [capacity]
+        bytes (default 1 MiB) and go out together as the next batch.
+        Batches are written from and padded with zeros to multiples of
+        [align] (default 1), use {!File.offset_align} for O_DIRECT. The
+        padding is overwritten by the next batch so the log has no
+        holes. If [offset] is not aligned the block in front of it is
+        read back first. *)
+
+  val commit : t -> Buffer.t -> int -> int -> (unit completion -> unit) -> unit
+    (** [commit t buf off len cont] copies the record into the current
+        batch and calls [cont] once it is durable. All records of a batch
+        get the same completion, [Partial] if the write came up short.
+        Once a batch failed the log is broken: records waiting for the
+        next batch get the same completion and further commits raise
+        the error. Blocks in the context while the batch is full. *)
+
+  val commit_bytes : t -> Bytes.t -> int -> int -> (unit completion -> unit) -> unit
+    (** like {!commit} *)
+
+  val commit_string : t -> string -> int -> int -> (unit completion -> unit) -> unit
+    (** like {!commit} *)
+
+  val offset : t -> int64
+    (** end of the records committed so far *)
+
+  val wait : t -> unit
+    (** run the context until all committed records are durable *)
+end
+
+module Sharded : sig
+  type t
+    (** A set of contexts, one per domain, to scale submission and
+        completion over several cores. Each shard has a lock so domains
+        running in parallel never change the same context. A thread
+        waiting for the lock sleeps. *)
+
+  val create : ?depth:int -> ?backend:backend -> ?cpus:int array ->
+               ?self:(unit -> int) -> int -> int -> t
+    (** [create n max_ios] creates [n] contexts for [max_ios] requests
+        each. [self] picks the shard of the caller, modulo [n]. The
+        default is the id of the calling domain, so each domain gets
+        its own shard (always 0 before OCaml 5). [cpus] gives the cpu
+        {!pin} binds the domain of each shard to. *)
+
+  val shards : t -> int
+    (** number of shards *)
+
+  val context : t -> int -> context
+    (** the context of a shard. Use it only through {!with_shard}
+        while other domains may touch the shard. *)
+
+  val local : t -> int
+    (** the shard of the calling domain *)
+
+  val with_shard : t -> int -> (context -> 'a) -> 'a
+    (** [with_shard t i f] locks shard [i] for the calling thread, runs
+        [f] on its context and unlocks it again. The lock can be taken
+        again from within [f]. While [f] waits in the kernel for
+        completions the lock is given up and other domains may use the
+        shard; it is taken back before [f] continues. *)
+
+  val with_local : t -> (context -> 'a) -> 'a
+    (** {!with_shard} for the shard of the calling domain *)
+
+  val pin : t -> unit
+    (** bind the calling thread to the cpu of its shard *)
+
+  val read : ?flags:rw_flag list -> t -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit
+  val read_sub : ?flags:rw_flag list -> t -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit
+  val write : ?flags:rw_flag list -> t -> Unix.file_descr -> int64 -> Buffer.t -> (result -> unit) -> unit
+  val write_sub : ?flags:rw_flag list -> t -> Unix.file_descr -> int64 -> Buffer.t -> int -> int -> (result -> unit) -> unit
+  val submit : t -> command array -> unit
+    (** like the functions of the same name on the local shard *)
+
+  val step : t -> unit
+  val run : t -> unit
+    (** like {!Aio.step} and {!Aio.run} on the local shard. The shard
+        is unlocked while they wait for the kernel, so other domains
+        can submit to it or steal from it meanwhile. *)
+
+  val steal : t -> unit
+    (** collect the completions of the other shards that no domain is
+        using right now and call their continuations in the calling
+        domain. Continuations must not care which domain runs them. *)
+
+  val process : t -> unit
+    (** collect the completions of the local shard without waiting,
+        then {!steal} *)
+
+  val pending : t -> int
+    (** requests pending over all shards, a snapshot *)
+end
+
 val sync_read : Unix.file_descr -> int64 -> Buffer.t -> unit
   (** fill buffer from file at given offset, blocking *)
 
@@ -64,10 +64,15 @@ external unsafe_get_int16 : t -> int -> int = "caml_aio_buffer_get_int16" "noall
 external unsafe_set_int16 : t -> int -> int -> unit = "caml_aio_buffer_set_int16" "noalloc"
 external unsafe_get_int31 : t -> int -> int = "caml_aio_buffer_get_int31" "noalloc"
 external unsafe_set_int31 : t -> int -> int -> unit = "caml_aio_buffer_set_int31" "noalloc"
-external unsafe_get_int32 : t -> int -> int32 = "caml_aio_buffer_get_int32"
-external unsafe_set_int32 : t -> int -> int32 -> unit = "caml_aio_buffer_set_int32" "noalloc"
-external unsafe_get_int64 : t -> int -> int64 = "caml_aio_buffer_get_int64"
-external unsafe_set_int64 : t -> int -> int64 -> unit = "caml_aio_buffer_set_int64" "noalloc"
+
+(* Compiled inline in native code, the int32/int64 values stay unboxed
+   unless they escape. Native byte order. *)
+external unsafe_get_int32 : t -> int -> int32 = "%caml_bigstring_get32u"
+external unsafe_set_int32 : t -> int -> int32 -> unit = "%caml_bigstring_set32u"
+external unsafe_get_int64 : t -> int -> int64 = "%caml_bigstring_get64u"
+external unsafe_set_int64 : t -> int -> int64 -> unit = "%caml_bigstring_set64u"
+external swap32 : int32 -> int32 = "%bswap_int32"
+external swap64 : int64 -> int64 = "%bswap_int64"
 
 let get_uint8 (buf : t) off =
   check buf off 1;
@@ -160,6 +165,54 @@ let set_str str =
     buf
 
 
+let check_range buf off len =
+  if off < 0 || len < 0 || off > length buf - len
+  then raise (Invalid_argument "Index out of bounds")
+
+external unsafe_blit_to_bytes : t -> int -> Bytes.t -> int -> int -> unit = "caml_aio_buffer_blit_to_bytes" "noalloc"
+external unsafe_blit_from_bytes : Bytes.t -> int -> t -> int -> int -> unit = "caml_aio_buffer_blit_from_bytes" "noalloc"
+external unsafe_blit_from_string : string -> int -> t -> int -> int -> unit = "caml_aio_buffer_blit_from_bytes" "noalloc"
+external unsafe_blit : t -> int -> t -> int -> int -> unit = "caml_aio_buffer_blit" "noalloc"
+external unsafe_fill : t -> int -> int -> int -> unit = "caml_aio_buffer_fill" "noalloc"
+external unsafe_compare : t -> int -> t -> int -> int -> int = "caml_aio_buffer_compare" "noalloc"
+
+let blit_to_bytes buf off bytes bytes_off len =
+  check_range buf off len;
+  if bytes_off < 0 || bytes_off > Bytes.length bytes - len
+  then raise (Invalid_argument "Index out of bounds");
+  unsafe_blit_to_bytes buf off bytes bytes_off len
+
+let blit_from_bytes bytes bytes_off buf off len =
+  check_range buf off len;
+  if bytes_off < 0 || bytes_off > Bytes.length bytes - len
+  then raise (Invalid_argument "Index out of bounds");
+  unsafe_blit_from_bytes bytes bytes_off buf off len
+
+let blit_from_string str str_off buf off len =
+  check_range buf off len;
+  if str_off < 0 || str_off > String.length str - len
+  then raise (Invalid_argument "Index out of bounds");
+  unsafe_blit_from_string str str_off buf off len
+
+let blit src src_off dst dst_off len =
+  check_range src src_off len;
+  check_range dst dst_off len;
+  unsafe_blit src src_off dst dst_off len
+
+let fill buf off len x =
+  check_range buf off len;
+  unsafe_fill buf off len x
+
+let compare buf1 off1 buf2 off2 len =
+  check_range buf1 off1 len;
+  check_range buf2 off2 len;
+  unsafe_compare buf1 off1 buf2 off2 len
+
+let sub (buf : t) off len =
+  check_range buf off len;
+  Array1.sub buf off len
+
+
 (* Big endian byte order *)
 let unsafe_get_be_int8 = unsafe_get_int8
 let unsafe_set_be_int8 = unsafe_set_int8
@@ -171,10 +224,26 @@ external unsafe_get_be_uint16 : t -> int -> int = "caml_aio_buffer_get_be_uint16
 external unsafe_set_be_uint16 : t -> int -> int -> unit = "caml_aio_buffer_set_be_uint16" "noalloc"
 external unsafe_get_be_int31 : t -> int -> int = "caml_aio_buffer_get_be_int31" "noalloc"
 external unsafe_set_be_int31 : t -> int -> int -> unit = "caml_aio_buffer_set_be_int31" "noalloc"
-external unsafe_get_be_int32 : t -> int -> int32 = "caml_aio_buffer_get_be_int32"
-external unsafe_set_be_int32 : t -> int -> int32 -> unit = "caml_aio_buffer_set_be_int32" "noalloc"
-external unsafe_get_be_int64 : t -> int -> int64 = "caml_aio_buffer_get_be_int64"
-external unsafe_set_be_int64 : t -> int -> int64 -> unit = "caml_aio_buffer_set_be_int64" "noalloc"
+
+let unsafe_get_be_int32 buf off =
+  if Sys.big_endian
+  then unsafe_get_int32 buf off
+  else swap32 (unsafe_get_int32 buf off)
+
+let unsafe_set_be_int32 buf off x =
+  if Sys.big_endian
+  then unsafe_set_int32 buf off x
+  else unsafe_set_int32 buf off (swap32 x)
+
+let unsafe_get_be_int64 buf off =
+  if Sys.big_endian
+  then unsafe_get_int64 buf off
+  else swap64 (unsafe_get_int64 buf off)
+
+let unsafe_set_be_int64 buf off x =
+  if Sys.big_endian
+  then unsafe_set_int64 buf off x
+  else unsafe_set_int64 buf off (swap64 x)
 
 let get_be_int8 = get_int8
 let set_be_int8 = set_int8
@@ -233,10 +302,26 @@ external unsafe_get_le_uint16 : t -> int -> int = "caml_aio_buffer_get_le_uint16
 external unsafe_set_le_uint16 : t -> int -> int -> unit = "caml_aio_buffer_set_le_uint16" "noalloc"
 external unsafe_get_le_int31 : t -> int -> int = "caml_aio_buffer_get_le_int31" "noalloc"
 external unsafe_set_le_int31 : t -> int -> int -> unit = "caml_aio_buffer_set_le_int31" "noalloc"
-external unsafe_get_le_int32 : t -> int -> int32 = "caml_aio_buffer_get_le_int32"
-external unsafe_set_le_int32 : t -> int -> int32 -> unit = "caml_aio_buffer_set_le_int32" "noalloc"
-external unsafe_get_le_int64 : t -> int -> int64 = "caml_aio_buffer_get_le_int64"
-external unsafe_set_le_int64 : t -> int -> int64 -> unit = "caml_aio_buffer_set_le_int64" "noalloc"
+
+let unsafe_get_le_int32 buf off =
+  if Sys.big_endian
+  then swap32 (unsafe_get_int32 buf off)
+  else unsafe_get_int32 buf off
+
+let unsafe_set_le_int32 buf off x =
+  if Sys.big_endian
+  then unsafe_set_int32 buf off (swap32 x)
+  else unsafe_set_int32 buf off x
+
+let unsafe_get_le_int64 buf off =
+  if Sys.big_endian
+  then swap64 (unsafe_get_int64 buf off)
+  else unsafe_get_int64 buf off
+
+let unsafe_set_le_int64 buf off x =
+  if Sys.big_endian
+  then unsafe_set_int64 buf off (swap64 x)
+  else unsafe_set_int64 buf off x
 
 let get_le_int8 = get_int8
 let set_le_int8 = set_int8
@@ -313,3 +398,164 @@ let get_net_int32 = get_be_int32
 let set_net_int32 = set_be_int32
 let get_net_int64 = get_be_int64
 let set_net_int64 = set_be_int64
+
+
+(* Buffers carved out of one large mapping *)
+module Pool = struct
+  type buffer = t
+  type region
+
+  exception Exhausted
+
+  external region_map : int -> int -> bool -> bool -> region = "caml_aio_buffer_region_map"
+  external region_buffer : region -> int -> buffer = "caml_aio_buffer_region_buffer"
+  external region_index : region -> buffer -> int = "caml_aio_buffer_region_index" "noalloc"
+
+  type t = {
+    region : region;
+    buffers : buffer array;
+    free : int array;		(* stack of free buffers *)
+    used : Bytes.t;		(* '\001' for buffers handed out *)
+    mutable top : int;		(* number of free buffers *)
+  }
+
+  let create ?(huge = false) ?(populate = false) size count =
+    let region = region_map size count huge populate
+    in
+      {
+	region = region;
+	buffers = Array.init count (region_buffer region);
+	free = Array.init count (fun i -> count - 1 - i);
+	used = Bytes.make count '\000';
+	top = count;
+      }
+
+  let buffer_size pool = length pool.buffers.(0)
+
+  let capacity pool = Array.length pool.buffers
+
+  let available pool = pool.top
+
+  let alloc pool =
+    if pool.top = 0
+    then raise Exhausted;
+    pool.top <- pool.top - 1;
+    let i = Array.unsafe_get pool.free pool.top
+    in
+      Bytes.unsafe_set pool.used i '\001';
+      Array.unsafe_get pool.buffers i
+
+  let free pool buf =
+    let i = region_index pool.region buf
+    in
+      if i < 0 || Bytes.get pool.used i = '\000'
+      then raise (Invalid_argument "Buffer.Pool.free: Not an allocated buffer of the pool.");
+      Bytes.unsafe_set pool.used i '\000';
+      Array.unsafe_set pool.free pool.top i;
+      pool.top <- pool.top + 1
+end
+
+
+(* Bulk conversion between the buffer and arrays of integers *)
+type int32s = (int32, int32_elt, c_layout) Array1.t
+type int64s = (int64, int64_elt, c_layout) Array1.t
+
+external unsafe_blit_int32_to_bigarray : bool -> t -> int -> int32s -> int -> int -> unit =
+  "caml_aio_buffer_blit_int32_to_bigarray_bytecode" "caml_aio_buffer_blit_int32_to_bigarray" "noalloc"
+external unsafe_blit_int32_to_array : bool -> t -> int -> int array -> int -> int -> unit =
+  "caml_aio_buffer_blit_int32_to_array_bytecode" "caml_aio_buffer_blit_int32_to_array" "noalloc"
+external unsafe_blit_int32_from_bigarray : bool -> t -> int -> int32s -> int -> int -> unit =
+  "caml_aio_buffer_blit_int32_from_bigarray_bytecode" "caml_aio_buffer_blit_int32_from_bigarray" "noalloc"
+external unsafe_blit_int32_from_array : bool -> t -> int -> int array -> int -> int -> unit =
+  "caml_aio_buffer_blit_int32_from_array_bytecode" "caml_aio_buffer_blit_int32_from_array" "noalloc"
+external unsafe_blit_int64_to_bigarray : bool -> t -> int -> int64s -> int -> int -> unit =
+  "caml_aio_buffer_blit_int64_to_bigarray_bytecode" "caml_aio_buffer_blit_int64_to_bigarray" "noalloc"
+external unsafe_blit_int64_to_array : bool -> t -> int -> int array -> int -> int -> unit =
+  "caml_aio_buffer_blit_int64_to_array_bytecode" "caml_aio_buffer_blit_int64_to_array" "noalloc"
+external unsafe_blit_int64_from_bigarray : bool -> t -> int -> int64s -> int -> int -> unit =
+  "caml_aio_buffer_blit_int64_from_bigarray_bytecode" "caml_aio_buffer_blit_int64_from_bigarray" "noalloc"
+external unsafe_blit_int64_from_array : bool -> t -> int -> int array -> int -> int -> unit =
+  "caml_aio_buffer_blit_int64_from_array_bytecode" "caml_aio_buffer_blit_int64_from_array" "noalloc"
+
+let check_blit buf off size arr_len arr_off n =
+  if off < 0 || arr_off < 0 || n < 0
+     || n > arr_len - arr_off || n > (length buf - off) / size
+  then raise (Invalid_argument "Index out of bounds")
+
+let blit_be_int32_to_bigarray buf off dst dst_off n =
+  check_blit buf off 4 (Array1.dim dst) dst_off n;
+  unsafe_blit_int32_to_bigarray (not Sys.big_endian) buf off dst dst_off n
+
+let blit_be_int32_to_array buf off dst dst_off n =
+  check_blit buf off 4 (Array.length dst) dst_off n;
+  unsafe_blit_int32_to_array (not Sys.big_endian) buf off dst dst_off n
+
+let blit_be_int32_from_bigarray buf off src src_off n =
+  check_blit buf off 4 (Array1.dim src) src_off n;
+  unsafe_blit_int32_from_bigarray (not Sys.big_endian) buf off src src_off n
+
+let blit_be_int32_from_array buf off src src_off n =
+  check_blit buf off 4 (Array.length src) src_off n;
+  unsafe_blit_int32_from_array (not Sys.big_endian) buf off src src_off n
+
+let blit_be_int64_to_bigarray buf off dst dst_off n =
+  check_blit buf off 8 (Array1.dim dst) dst_off n;
+  unsafe_blit_int64_to_bigarray (not Sys.big_endian) buf off dst dst_off n
+
+let blit_be_int64_to_array buf off dst dst_off n =
+  check_blit buf off 8 (Array.length dst) dst_off n;
+  unsafe_blit_int64_to_array (not Sys.big_endian) buf off dst dst_off n
+
+let blit_be_int64_from_bigarray buf off src src_off n =
+  check_blit buf off 8 (Array1.dim src) src_off n;
+  unsafe_blit_int64_from_bigarray (not Sys.big_endian) buf off src src_off n
+
+let blit_be_int64_from_array buf off src src_off n =
+  check_blit buf off 8 (Array.length src) src_off n;
+  unsafe_blit_int64_from_array (not Sys.big_endian) buf off src src_off n
+
+
+let blit_le_int32_to_bigarray buf off dst dst_off n =
+  check_blit buf off 4 (Array1.dim dst) dst_off n;
+  unsafe_blit_int32_to_bigarray (Sys.big_endian) buf off dst dst_off n
+
+let blit_le_int32_to_array buf off dst dst_off n =
+  check_blit buf off 4 (Array.length dst) dst_off n;
+  unsafe_blit_int32_to_array (Sys.big_endian) buf off dst dst_off n
+
+let blit_le_int32_from_bigarray buf off src src_off n =
+  check_blit buf off 4 (Array1.dim src) src_off n;
+  unsafe_blit_int32_from_bigarray (Sys.big_endian) buf off src src_off n
+
+let blit_le_int32_from_array buf off src src_off n =
+  check_blit buf off 4 (Array.length src) src_off n;
+  unsafe_blit_int32_from_array (Sys.big_endian) buf off src src_off n
+
+let blit_le_int64_to_bigarray buf off dst dst_off n =
+  check_blit buf off 8 (Array1.dim dst) dst_off n;
+  unsafe_blit_int64_to_bigarray (Sys.big_endian) buf off dst dst_off n
+
+let blit_le_int64_to_array buf off dst dst_off n =
+  check_blit buf off 8 (Array.length dst) dst_off n;
+  unsafe_blit_int64_to_array (Sys.big_endian) buf off dst dst_off n
+
+let blit_le_int64_from_bigarray buf off src src_off n =
+  check_blit buf off 8 (Array1.dim src) src_off n;
+  unsafe_blit_int64_from_bigarray (Sys.big_endian) buf off src src_off n
+
+let blit_le_int64_from_array buf off src src_off n =
+  check_blit buf off 8 (Array.length src) src_off n;
+  unsafe_blit_int64_from_array (Sys.big_endian) buf off src src_off n
+
+
+(* Checksums *)
+external unsafe_crc32c : t -> int -> int -> int -> int = "caml_aio_buffer_crc32c" "noalloc"
+external unsafe_xxhash64 : t -> int -> int -> int64 -> int64 = "caml_aio_buffer_xxhash64"
+
+let crc32c ?(crc = 0) buf off len =
+  check_range buf off len;
+  unsafe_crc32c buf off len crc
+
+let xxhash64 ?(seed = 0L) buf off len =
+  check_range buf off len;
+  unsafe_xxhash64 buf off len seed
@@ -22,13 +22,21 @@
 #include <string.h>
 #include <endian.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
 #include <caml/alloc.h>
 #include <caml/fail.h>
+#include <caml/custom.h>
 #include <caml/bigarray.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_SWAP
+#define HAVE_SSE42_CRC
+#endif
+
 #define PAGE_SIZE (sysconf(_SC_PAGESIZE))
 
 value caml_aio_buffer_page_size(void) {
@@ -55,6 +63,131 @@ CAMLprim value caml_aio_buffer_create(value ml_size) {
     CAMLreturn(caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, mem, size));
 }
 
+/* A pool region is one block of memory carved into count buffers of
+ * size bytes. The buffers are managed bigarrays sharing the proxy of
+ * the region: the region and every buffer, sub-arrays included, hold a
+ * reference on it and whoever drops the last one frees the memory. A
+ * buffer outliving its pool stays valid.
+ */
+typedef struct Region {
+    char *base;
+    size_t size;	// bytes per buffer
+    size_t count;	// number of buffers
+    struct caml_ba_proxy *proxy;
+} Region;
+
+#define Region_val(v) ((Region*)Data_custom_val(v))
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static void caml_aio_buffer_region_finalize(value v) {
+    struct caml_ba_proxy *proxy = Region_val(v)->proxy;
+    // Same as the bigarray finalizer does for the buffers
+    if (proxy != NULL && --proxy->refcount == 0) {
+	free(proxy->data);
+	free(proxy);
+    }
+}
+
+static struct custom_operations caml_aio_buffer_region_ops = {
+    "vonbrederlow.de.aio.buffer.region",
+    caml_aio_buffer_region_finalize,
+    custom_compare_default,
+    custom_hash_default,
+    custom_serialize_default,
+    custom_deserialize_default,
+    custom_compare_ext_default,
+};
+
+// external region_map : int -> int -> bool -> bool -> region = "caml_aio_buffer_region_map"
+CAMLprim value caml_aio_buffer_region_map(value ml_size, value ml_count, value ml_huge, value ml_populate) {
+    CAMLparam4(ml_size, ml_count, ml_huge, ml_populate);
+    CAMLlocal1(ml_region);
+    size_t size = Long_val(ml_size);
+    size_t count = Long_val(ml_count);
+    struct caml_ba_proxy *proxy;
+    size_t len, off;
+    void *mem;
+
+    if (Long_val(ml_size) <= 0 || size % PAGE_SIZE != 0) {
+	caml_invalid_argument("Buffer.Pool.create: Size not multiple of PAGE_SIZE.");
+    }
+    if (Long_val(ml_count) <= 0 || count > SIZE_MAX / size) {
+	caml_invalid_argument("Buffer.Pool.create: Invalid count.");
+    }
+    len = size * count;
+
+    // The runtime frees the memory of managed bigarrays with free(), so
+    // it can't be a mapping of its own. Large blocks are mapped by
+    // malloc anyway.
+    if (Bool_val(ml_huge)) {
+	// Transparent huge pages need the block aligned to their size
+	len = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (posix_memalign(&mem, HUGE_PAGE_SIZE, len) != 0) mem = NULL;
+	if (mem != NULL) (void)madvise(mem, len, MADV_HUGEPAGE);
+    } else {
+	if (posix_memalign(&mem, PAGE_SIZE, len) != 0) mem = NULL;
+    }
+    proxy = malloc(sizeof(struct caml_ba_proxy));
+    if (mem == NULL || proxy == NULL) {
+	free(mem);
+	free(proxy);
+	caml_failwith("Buffer.Pool.create: Out of memory.");
+    }
+    if (Bool_val(ml_populate)) {
+	// Fault in every page now
+	for (off = 0; off < len; off += PAGE_SIZE) {
+	    ((volatile char*)mem)[off] = 0;
+	}
+    }
+    proxy->refcount = 1;
+    proxy->data = mem;
+    proxy->size = len;
+
+    ml_region = caml_alloc_custom(&caml_aio_buffer_region_ops, sizeof(Region), 0, 1);
+    Region_val(ml_region)->base = mem;
+    Region_val(ml_region)->size = size;
+    Region_val(ml_region)->count = count;
+    Region_val(ml_region)->proxy = proxy;
+
+    CAMLreturn(ml_region);
+}
+
+// external region_buffer : region -> int -> t = "caml_aio_buffer_region_buffer"
+CAMLprim value caml_aio_buffer_region_buffer(value ml_region, value ml_index) {
+    CAMLparam2(ml_region, ml_index);
+    CAMLlocal1(ml_buf);
+    Region *region = Region_val(ml_region);
+    size_t index = Long_val(ml_index);
+
+    ml_buf = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1,
+				region->base + index * region->size, region->size);
+    // The allocation may have run the GC, look the region up again
+    region = Region_val(ml_region);
+    // Keep the memory alive as long as the buffer, sub-arrays of it
+    // share the proxy and its count
+    ++region->proxy->refcount;
+    Caml_ba_array_val(ml_buf)->proxy = region->proxy;
+
+    CAMLreturn(ml_buf);
+}
+
+// external region_index : region -> t -> int = "caml_aio_buffer_region_index" "noalloc"
+value caml_aio_buffer_region_index(value ml_region, value ml_buf) {
+    Region *region = Region_val(ml_region);
+    char *buf = (char*)Data_bigarray_val(ml_buf);
+    size_t off;
+
+    if (buf < region->base || (size_t)Bigarray_val(ml_buf)->dim[0] != region->size) {
+	return Val_int(-1);
+    }
+    off = buf - region->base;
+    if (off % region->size != 0 || off / region->size >= region->count) {
+	return Val_int(-1);
+    }
+    return Val_long(off / region->size);
+}
+
 value caml_aio_buffer_get_int8(value ml_buf, value ml_off) {
     int8_t *buf = (int8_t*)Data_bigarray_val(ml_buf);
     size_t off = Int_val(ml_off);
@@ -111,38 +244,6 @@ value caml_aio_buffer_set_int31(value ml_buf, value ml_off, value ml_x) {
     return Val_unit;
 }
 
-CAMLprim value caml_aio_buffer_get_int32(value ml_buf, value ml_off) {
-    CAMLparam2(ml_buf, ml_off);
-    CAMLlocal1(ml_res);
-    int32_t *buf = (int32_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    CAMLreturn(caml_copy_int32(buf[off / 4]));
-}
-
-value caml_aio_buffer_set_int32(value ml_buf, value ml_off, value ml_x) {
-    int32_t *buf = (int32_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    int32_t x = Int32_val(ml_x);
-    buf[off / 4] = x;
-    return Val_unit;
-}
-
-CAMLprim value caml_aio_buffer_get_int64(value ml_buf, value ml_off) {
-    CAMLparam2(ml_buf, ml_off);
-    CAMLlocal1(ml_res);
-    int64_t *buf = (int64_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    CAMLreturn(caml_copy_int64(buf[off / 8]));
-}
-
-value caml_aio_buffer_set_int64(value ml_buf, value ml_off, value ml_x) {
-    int64_t *buf = (int64_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    int64_t x = Int64_val(ml_x);
-    buf[off / 8] = x;
-    return Val_unit;
-}
-
 // external unsafe_get_substr : t -> int -> int -> string = "caml_aio_buf_unsafe_get_substr_stub"
 value caml_aio_buf_unsafe_get_substr_stub(value ml_buf, value ml_off, value ml_len) {
     CAMLparam3(ml_buf, ml_off, ml_len);
@@ -171,6 +272,41 @@ value caml_aio_buf_unsafe_set_substr_stub(value ml_buf, value ml_off, value ml_s
     CAMLreturn(Val_unit);
 }
 
+// external unsafe_blit_to_bytes : t -> int -> Bytes.t -> int -> int -> unit
+value caml_aio_buffer_blit_to_bytes(value ml_buf, value ml_off, value ml_bytes, value ml_bytes_off, value ml_len) {
+    memcpy(Bytes_val(ml_bytes) + Long_val(ml_bytes_off),
+	   (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off), Long_val(ml_len));
+    return Val_unit;
+}
+
+// external unsafe_blit_from_bytes : Bytes.t -> int -> t -> int -> int -> unit
+// external unsafe_blit_from_string : string -> int -> t -> int -> int -> unit
+value caml_aio_buffer_blit_from_bytes(value ml_bytes, value ml_bytes_off, value ml_buf, value ml_off, value ml_len) {
+    memcpy((char*)Data_bigarray_val(ml_buf) + Long_val(ml_off),
+	   String_val(ml_bytes) + Long_val(ml_bytes_off), Long_val(ml_len));
+    return Val_unit;
+}
+
+// external unsafe_blit : t -> int -> t -> int -> int -> unit
+value caml_aio_buffer_blit(value ml_src, value ml_src_off, value ml_dst, value ml_dst_off, value ml_len) {
+    memmove((char*)Data_bigarray_val(ml_dst) + Long_val(ml_dst_off),
+	    (char*)Data_bigarray_val(ml_src) + Long_val(ml_src_off), Long_val(ml_len));
+    return Val_unit;
+}
+
+// external unsafe_fill : t -> int -> int -> int -> unit
+value caml_aio_buffer_fill(value ml_buf, value ml_off, value ml_len, value ml_x) {
+    memset((char*)Data_bigarray_val(ml_buf) + Long_val(ml_off), Int_val(ml_x), Long_val(ml_len));
+    return Val_unit;
+}
+
+// external unsafe_compare : t -> int -> t -> int -> int -> int
+value caml_aio_buffer_compare(value ml_buf1, value ml_off1, value ml_buf2, value ml_off2, value ml_len) {
+    int res = memcmp((char*)Data_bigarray_val(ml_buf1) + Long_val(ml_off1),
+		     (char*)Data_bigarray_val(ml_buf2) + Long_val(ml_off2), Long_val(ml_len));
+    return Val_int((res > 0) - (res < 0));
+}
+
 // Big endian byte order
 value caml_aio_buffer_get_be_int16(value ml_buf, value ml_off) {
     int16_t *buf = (int16_t*)Data_bigarray_val(ml_buf);
@@ -214,38 +350,6 @@ value caml_aio_buffer_set_be_int31(value ml_buf, value ml_off, value ml_x) {
     return Val_unit;
 }
 
-CAMLprim value caml_aio_buffer_get_be_int32(value ml_buf, value ml_off) {
-    CAMLparam2(ml_buf, ml_off);
-    CAMLlocal1(ml_res);
-    int32_t *buf = (int32_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    CAMLreturn(caml_copy_int32((int32_t)be32toh(buf[off / 4])));
-}
-
-value caml_aio_buffer_set_be_int32(value ml_buf, value ml_off, value ml_x) {
-    int32_t *buf = (int32_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    int32_t x = Int32_val(ml_x);
-    buf[off / 4] = htobe32(x);
-    return Val_unit;
-}
-
-CAMLprim value caml_aio_buffer_get_be_int64(value ml_buf, value ml_off) {
-    CAMLparam2(ml_buf, ml_off);
-    CAMLlocal1(ml_res);
-    int64_t *buf = (int64_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    CAMLreturn(caml_copy_int64((int64_t)be64toh(buf[off / 8])));
-}
-#include <stdio.h>
-value caml_aio_buffer_set_be_int64(value ml_buf, value ml_off, value ml_x) {
-    int64_t *buf = (int64_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    int64_t x = Int64_val(ml_x);
-    buf[off / 8] = htobe64(x);
-    return Val_unit;
-}
-
 
 // Little endian byte order
 value caml_aio_buffer_get_le_int16(value ml_buf, value ml_off) {
@@ -290,34 +394,384 @@ value caml_aio_buffer_set_le_int31(value ml_buf, value ml_off, value ml_x) {
     return Val_unit;
 }
 
-CAMLprim value caml_aio_buffer_get_le_int32(value ml_buf, value ml_off) {
-    CAMLparam2(ml_buf, ml_off);
-    CAMLlocal1(ml_res);
-    int32_t *buf = (int32_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    CAMLreturn(caml_copy_int32((int32_t)le32toh(buf[off / 4])));
+
+
+// Bulk conversion between the buffer and arrays of integers
+
+// Copy n 32bit values from src to dst reversing the byte order
+static void caml_aio_buffer_swap32(void *dst, const void *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+	uint32_t x;
+	memcpy(&x, (const char*)src + 4 * i, 4);
+	x = __builtin_bswap32(x);
+	memcpy((char*)dst + 4 * i, &x, 4);
+    }
 }
 
-value caml_aio_buffer_set_le_int32(value ml_buf, value ml_off, value ml_x) {
-    int32_t *buf = (int32_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    int32_t x = Int32_val(ml_x);
-    buf[off / 4] = htole32(x);
+// Copy n 64bit values from src to dst reversing the byte order
+static void caml_aio_buffer_swap64(void *dst, const void *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+	uint64_t x;
+	memcpy(&x, (const char*)src + 8 * i, 8);
+	x = __builtin_bswap64(x);
+	memcpy((char*)dst + 8 * i, &x, 8);
+    }
+}
+
+#ifdef HAVE_AVX2_SWAP
+// Same with a byte shuffle over 32 bytes at a time
+__attribute__((target("avx2")))
+static void caml_aio_buffer_swap32_avx2(void *dst, const void *src, size_t n) {
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					  11, 10, 9, 8, 15, 14, 13, 12,
+					  3, 2, 1, 0, 7, 6, 5, 4,
+					  11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m256i x = _mm256_loadu_si256((const __m256i*)((const char*)src + 4 * i));
+	_mm256_storeu_si256((__m256i*)((char*)dst + 4 * i), _mm256_shuffle_epi8(x, mask));
+    }
+    caml_aio_buffer_swap32((char*)dst + 4 * i, (const char*)src + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void caml_aio_buffer_swap64_avx2(void *dst, const void *src, size_t n) {
+    const __m256i mask = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+					  15, 14, 13, 12, 11, 10, 9, 8,
+					  7, 6, 5, 4, 3, 2, 1, 0,
+					  15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m256i x = _mm256_loadu_si256((const __m256i*)((const char*)src + 8 * i));
+	_mm256_storeu_si256((__m256i*)((char*)dst + 8 * i), _mm256_shuffle_epi8(x, mask));
+    }
+    caml_aio_buffer_swap64((char*)dst + 8 * i, (const char*)src + 8 * i, n - i);
+}
+#endif
+
+// Copy n values of size bytes, reversing the byte order if swap is set
+static void caml_aio_buffer_copy(void *dst, const void *src, size_t n, int size, int swap) {
+    if (!swap) {
+	memmove(dst, src, n * size);
+	return;
+    }
+#ifdef HAVE_AVX2_SWAP
+    if (__builtin_cpu_supports("avx2")) {
+	if (size == 4) caml_aio_buffer_swap32_avx2(dst, src, n);
+	else caml_aio_buffer_swap64_avx2(dst, src, n);
+	return;
+    }
+#endif
+    if (size == 4) caml_aio_buffer_swap32(dst, src, n);
+    else caml_aio_buffer_swap64(dst, src, n);
+}
+
+// external unsafe_blit_int32_to_bigarray : bool -> t -> int -> int32s -> int -> int -> unit
+value caml_aio_buffer_blit_int32_to_bigarray(value ml_swap, value ml_buf, value ml_off, value ml_dst, value ml_dst_off, value ml_n) {
+    char *buf = (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    int32_t *dst = (int32_t*)Data_bigarray_val(ml_dst) + Long_val(ml_dst_off);
+    caml_aio_buffer_copy(dst, buf, Long_val(ml_n), 4, Bool_val(ml_swap));
     return Val_unit;
 }
 
-CAMLprim value caml_aio_buffer_get_le_int64(value ml_buf, value ml_off) {
-    CAMLparam2(ml_buf, ml_off);
-    CAMLlocal1(ml_res);
-    int64_t *buf = (int64_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    CAMLreturn(caml_copy_int64((int64_t)le64toh(buf[off / 8])));
+value caml_aio_buffer_blit_int32_to_bigarray_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int32_to_bigarray(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
 }
-#include <stdio.h>
-value caml_aio_buffer_set_le_int64(value ml_buf, value ml_off, value ml_x) {
-    int64_t *buf = (int64_t*)Data_bigarray_val(ml_buf);
-    size_t off = Int_val(ml_off);
-    int64_t x = Int64_val(ml_x);
-    buf[off / 8] = htole64(x);
+
+// external unsafe_blit_int32_from_bigarray : bool -> t -> int -> int32s -> int -> int -> unit
+value caml_aio_buffer_blit_int32_from_bigarray(value ml_swap, value ml_buf, value ml_off, value ml_src, value ml_src_off, value ml_n) {
+    char *buf = (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    int32_t *src = (int32_t*)Data_bigarray_val(ml_src) + Long_val(ml_src_off);
+    caml_aio_buffer_copy(buf, src, Long_val(ml_n), 4, Bool_val(ml_swap));
+    return Val_unit;
+}
+
+value caml_aio_buffer_blit_int32_from_bigarray_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int32_from_bigarray(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+// external unsafe_blit_int64_to_bigarray : bool -> t -> int -> int64s -> int -> int -> unit
+value caml_aio_buffer_blit_int64_to_bigarray(value ml_swap, value ml_buf, value ml_off, value ml_dst, value ml_dst_off, value ml_n) {
+    char *buf = (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    int64_t *dst = (int64_t*)Data_bigarray_val(ml_dst) + Long_val(ml_dst_off);
+    caml_aio_buffer_copy(dst, buf, Long_val(ml_n), 8, Bool_val(ml_swap));
+    return Val_unit;
+}
+
+value caml_aio_buffer_blit_int64_to_bigarray_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int64_to_bigarray(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+// external unsafe_blit_int64_from_bigarray : bool -> t -> int -> int64s -> int -> int -> unit
+value caml_aio_buffer_blit_int64_from_bigarray(value ml_swap, value ml_buf, value ml_off, value ml_src, value ml_src_off, value ml_n) {
+    char *buf = (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    int64_t *src = (int64_t*)Data_bigarray_val(ml_src) + Long_val(ml_src_off);
+    caml_aio_buffer_copy(buf, src, Long_val(ml_n), 8, Bool_val(ml_swap));
+    return Val_unit;
+}
+
+value caml_aio_buffer_blit_int64_from_bigarray_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int64_from_bigarray(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+// external unsafe_blit_int32_to_array : bool -> t -> int -> int array -> int -> int -> unit
+value caml_aio_buffer_blit_int32_to_array(value ml_swap, value ml_buf, value ml_off, value ml_dst, value ml_dst_off, value ml_n) {
+    const char *buf = (const char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    value *dst = &Field(ml_dst, Long_val(ml_dst_off));
+    size_t n = Long_val(ml_n);
+    size_t i;
+    for (i = 0; i < n; ++i) {
+	uint32_t x;
+	memcpy(&x, buf + 4 * i, 4);
+	if (Bool_val(ml_swap)) x = __builtin_bswap32(x);
+	// Ints need no write barrier
+	dst[i] = Val_long((int32_t)x);
+    }
     return Val_unit;
 }
+
+value caml_aio_buffer_blit_int32_to_array_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int32_to_array(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+// external unsafe_blit_int32_from_array : bool -> t -> int -> int array -> int -> int -> unit
+value caml_aio_buffer_blit_int32_from_array(value ml_swap, value ml_buf, value ml_off, value ml_src, value ml_src_off, value ml_n) {
+    char *buf = (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    value *src = &Field(ml_src, Long_val(ml_src_off));
+    size_t n = Long_val(ml_n);
+    size_t i;
+    for (i = 0; i < n; ++i) {
+	uint32_t x = Long_val(src[i]);
+	if (Bool_val(ml_swap)) x = __builtin_bswap32(x);
+	memcpy(buf + 4 * i, &x, 4);
+    }
+    return Val_unit;
+}
+
+value caml_aio_buffer_blit_int32_from_array_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int32_from_array(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+// external unsafe_blit_int64_to_array : bool -> t -> int -> int array -> int -> int -> unit
+value caml_aio_buffer_blit_int64_to_array(value ml_swap, value ml_buf, value ml_off, value ml_dst, value ml_dst_off, value ml_n) {
+    const char *buf = (const char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    value *dst = &Field(ml_dst, Long_val(ml_dst_off));
+    size_t n = Long_val(ml_n);
+    size_t i;
+    for (i = 0; i < n; ++i) {
+	uint64_t x;
+	memcpy(&x, buf + 8 * i, 8);
+	if (Bool_val(ml_swap)) x = __builtin_bswap64(x);
+	// Ints need no write barrier
+	dst[i] = Val_long((int64_t)x);
+    }
+    return Val_unit;
+}
+
+value caml_aio_buffer_blit_int64_to_array_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int64_to_array(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+// external unsafe_blit_int64_from_array : bool -> t -> int -> int array -> int -> int -> unit
+value caml_aio_buffer_blit_int64_from_array(value ml_swap, value ml_buf, value ml_off, value ml_src, value ml_src_off, value ml_n) {
+    char *buf = (char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    value *src = &Field(ml_src, Long_val(ml_src_off));
+    size_t n = Long_val(ml_n);
+    size_t i;
+    for (i = 0; i < n; ++i) {
+	uint64_t x = (int64_t)Long_val(src[i]);
+	if (Bool_val(ml_swap)) x = __builtin_bswap64(x);
+	memcpy(buf + 8 * i, &x, 8);
+    }
+    return Val_unit;
+}
+
+value caml_aio_buffer_blit_int64_from_array_bytecode(value *argv, int argn) {
+    (void)argn;
+    return caml_aio_buffer_blit_int64_from_array(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+
+// Checksums over a range of the buffer
+
+// CRC32C (Castagnoli), reflected polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t caml_aio_crc32c_table[8][256];
+static int caml_aio_crc32c_table_ready = 0;
+
+static void caml_aio_crc32c_init(void) {
+    uint32_t i, j, crc;
+    for (i = 0; i < 256; ++i) {
+	crc = i;
+	for (j = 0; j < 8; ++j) crc = (crc >> 1) ^ (-(crc & 1) & CRC32C_POLY);
+	caml_aio_crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i) {
+	crc = caml_aio_crc32c_table[0][i];
+	for (j = 1; j < 8; ++j) {
+	    crc = caml_aio_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+	    caml_aio_crc32c_table[j][i] = crc;
+	}
+    }
+    caml_aio_crc32c_table_ready = 1;
+}
+
+// Slicing by 8, for CPUs without a crc32 instruction
+static uint32_t caml_aio_crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    if (!caml_aio_crc32c_table_ready) caml_aio_crc32c_init();
+    while (len >= 8) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	x = htole64(x) ^ crc;
+	crc = caml_aio_crc32c_table[7][x & 0xff]
+	    ^ caml_aio_crc32c_table[6][(x >> 8) & 0xff]
+	    ^ caml_aio_crc32c_table[5][(x >> 16) & 0xff]
+	    ^ caml_aio_crc32c_table[4][(x >> 24) & 0xff]
+	    ^ caml_aio_crc32c_table[3][(x >> 32) & 0xff]
+	    ^ caml_aio_crc32c_table[2][(x >> 40) & 0xff]
+	    ^ caml_aio_crc32c_table[1][(x >> 48) & 0xff]
+	    ^ caml_aio_crc32c_table[0][x >> 56];
+	p += 8;
+	len -= 8;
+    }
+    while (len-- > 0) {
+	crc = caml_aio_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t caml_aio_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	crc64 = _mm_crc32_u64(crc64, x);
+	p += 8;
+	len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+// external unsafe_crc32c : t -> int -> int -> int -> int = "caml_aio_buffer_crc32c" "noalloc"
+value caml_aio_buffer_crc32c(value ml_buf, value ml_off, value ml_len, value ml_crc) {
+    const unsigned char *buf = (const unsigned char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    size_t len = Long_val(ml_len);
+    uint32_t crc = ~(uint32_t)Long_val(ml_crc);
+
+#ifdef HAVE_SSE42_CRC
+    if (__builtin_cpu_supports("sse4.2")) {
+	crc = caml_aio_crc32c_hw(crc, buf, len);
+    } else
+#endif
+    {
+	crc = caml_aio_crc32c_sw(crc, buf, len);
+    }
+    return Val_long(~crc);
+}
+
+// XXH64
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t caml_aio_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t caml_aio_read64(const unsigned char *p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return le64toh(x);
+}
+
+static inline uint32_t caml_aio_read32(const unsigned char *p) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return le32toh(x);
+}
+
+static inline uint64_t caml_aio_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = caml_aio_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t caml_aio_xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= caml_aio_xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t caml_aio_xxh64(const unsigned char *p, size_t len, uint64_t seed) {
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+	uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	uint64_t v2 = seed + XXH_PRIME64_2;
+	uint64_t v3 = seed;
+	uint64_t v4 = seed - XXH_PRIME64_1;
+	do {
+	    v1 = caml_aio_xxh64_round(v1, caml_aio_read64(p));
+	    v2 = caml_aio_xxh64_round(v2, caml_aio_read64(p + 8));
+	    v3 = caml_aio_xxh64_round(v3, caml_aio_read64(p + 16));
+	    v4 = caml_aio_xxh64_round(v4, caml_aio_read64(p + 24));
+	    p += 32;
+	} while (end - p >= 32);
+	h = caml_aio_rotl64(v1, 1) + caml_aio_rotl64(v2, 7)
+	    + caml_aio_rotl64(v3, 12) + caml_aio_rotl64(v4, 18);
+	h = caml_aio_xxh64_merge(h, v1);
+	h = caml_aio_xxh64_merge(h, v2);
+	h = caml_aio_xxh64_merge(h, v3);
+	h = caml_aio_xxh64_merge(h, v4);
+    } else {
+	h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    while (end - p >= 8) {
+	h ^= caml_aio_xxh64_round(0, caml_aio_read64(p));
+	h = caml_aio_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	p += 8;
+    }
+    if (end - p >= 4) {
+	h ^= (uint64_t)caml_aio_read32(p) * XXH_PRIME64_1;
+	h = caml_aio_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+	p += 4;
+    }
+    while (p < end) {
+	h ^= (*p++) * XXH_PRIME64_5;
+	h = caml_aio_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// external unsafe_xxhash64 : t -> int -> int -> int64 -> int64 = "caml_aio_buffer_xxhash64"
+CAMLprim value caml_aio_buffer_xxhash64(value ml_buf, value ml_off, value ml_len, value ml_seed) {
+    CAMLparam4(ml_buf, ml_off, ml_len, ml_seed);
+    const unsigned char *buf = (const unsigned char*)Data_bigarray_val(ml_buf) + Long_val(ml_off);
+    uint64_t h = caml_aio_xxh64(buf, Long_val(ml_len), Int64_val(ml_seed));
+    CAMLreturn(caml_copy_int64(h));
+}
@@ -0,0 +1,100 @@
+(* aio_lwt.ml: Lwt integration for libaio-ocaml
+ * Copyright (C) 2026 The libaio-ocaml contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * Under Debian a copy can be found in /usr/share/common-licenses/LGPL-2.1.
+ *)
+
+type t = {
+  ctx : Aio.context;
+  mutable event : Lwt_engine.event option;
+  waiters : int Lwt.u Aio.Cookies.t;
+}
+
+(* Filler for unused cookies, never woken *)
+let nobody = snd (Lwt.wait ())
+
+let wake u = function
+    Aio.Result n -> Lwt.wakeup u n
+  | Aio.Partial (_, n) -> Lwt.wakeup u n
+  | Aio.Errno err -> Lwt.wakeup_exn u (Aio.Error err)
+
+(* Wake the promises of all completed requests *)
+let drain t = Aio.Cookies.drain t.waiters wake
+
+let create ?depth ?backend ?batch max_ios =
+  let ctx = Aio.context ?depth ?backend max_ios in
+  let t = {
+    ctx = ctx;
+    event = None;
+    waiters = Aio.Cookies.create ?batch ctx nobody;
+  }
+  in
+    t.event <- Some (Lwt_engine.on_readable (Aio.fd ctx) (fun _ -> drain t));
+    t
+
+let context t = t.ctx
+
+let close t =
+  match t.event with
+    None -> ()
+  | Some ev -> Lwt_engine.stop_event ev; t.event <- None
+
+let read t fd off buf buf_off len =
+  let p, u = Lwt.wait ()
+  in
+    Aio.Cookies.read t.waiters fd off buf buf_off len u;
+    p
+
+let write t fd off buf buf_off len =
+  let p, u = Lwt.wait ()
+  in
+    Aio.Cookies.write t.waiters fd off buf buf_off len u;
+    p
+
+(* Vectored and sync requests have no tagged form and keep a
+ * continuation *)
+let wake_vec u = function
+    Aio.Result bufs ->
+      Lwt.wakeup u (Array.fold_left (fun acc b -> acc + Aio.Buffer.length b) 0 bufs)
+  | Aio.Partial (_, n) -> Lwt.wakeup u n
+  | Aio.Errno err -> Lwt.wakeup_exn u (Aio.Error err)
+
+let wake_sync u = function
+    Aio.Errno err -> Lwt.wakeup_exn u (Aio.Error err)
+  | _ -> Lwt.wakeup u ()
+
+let readv t fd off bufs =
+  let p, u = Lwt.wait ()
+  in
+    Aio.readv t.ctx fd off bufs (wake_vec u);
+    p
+
+let writev t fd off bufs =
+  let p, u = Lwt.wait ()
+  in
+    Aio.writev t.ctx fd off bufs (wake_vec u);
+    p
+
+let fsync t fd =
+  let p, u = Lwt.wait ()
+  in
+    Aio.fsync t.ctx fd (wake_sync u);
+    p
+
+let fdatasync t fd =
+  let p, u = Lwt.wait ()
+  in
+    Aio.fdatasync t.ctx fd (wake_sync u);
+    p
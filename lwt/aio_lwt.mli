@@ -0,0 +1,63 @@
+(* aio_lwt.mli: Lwt integration for libaio-ocaml
+ * Copyright (C) 2026 The libaio-ocaml contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * Under Debian a copy can be found in /usr/share/common-licenses/LGPL-2.1.
+ *)
+
+(** Aio requests as Lwt promises.
+
+    The eventfd of the context is registered with the Lwt engine once.
+    Every time it becomes readable all completed requests are collected
+    in batches and their promises resolved. Reads and writes are
+    submitted as tagged requests and cost no closure per request.
+
+    Promises of failed requests are rejected with [Aio.Error]. A short
+    read or write resolves with the number of bytes transferred.
+*)
+
+type t
+  (** An Aio context driven by the Lwt main loop. *)
+
+val create : ?depth:int -> ?backend:Aio.backend -> ?batch:int -> int -> t
+  (** [create max_ios] creates a context like {!Aio.context} and
+      registers it with the Lwt engine. Completions are collected
+      [batch] (default 64) at a time. *)
+
+val context : t -> Aio.context
+  (** the underlying context *)
+
+val close : t -> unit
+  (** stop watching the context. Pending promises are not resolved
+      anymore. *)
+
+val read : t -> Unix.file_descr -> int64 -> Aio.Buffer.t -> int -> int -> int Lwt.t
+  (** [read t fd off buf buf_off len] reads into the range of the
+      buffer and resolves to the number of bytes read *)
+
+val write : t -> Unix.file_descr -> int64 -> Aio.Buffer.t -> int -> int -> int Lwt.t
+  (** [write t fd off buf buf_off len] writes the range of the buffer
+      and resolves to the number of bytes written *)
+
+val readv : t -> Unix.file_descr -> int64 -> Aio.Buffer.t array -> int Lwt.t
+  (** like {!Aio.readv} *)
+
+val writev : t -> Unix.file_descr -> int64 -> Aio.Buffer.t array -> int Lwt.t
+  (** like {!Aio.writev} *)
+
+val fsync : t -> Unix.file_descr -> unit Lwt.t
+  (** like {!Aio.fsync} *)
+
+val fdatasync : t -> Unix.file_descr -> unit Lwt.t
+  (** like {!Aio.fdatasync} *)